@@ -17,13 +17,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
 
 #include <time.h>
 #include <sys/time.h>
+#include <sys/select.h>
 static uint64_t get_time_usec() {
 	struct timeval time;
 	gettimeofday(&time, NULL);
@@ -33,6 +44,9 @@ static uint64_t get_time_usec() {
 #define ERR_EXIT(...) \
 	do { fprintf(stderr, __VA_ARGS__); exit(1); } while (0)
 
+#define STR1(x) #x
+#define STR(x) STR1(x)
+
 #define DISP_CHECK_START 176
 #define DISP_CHECK_END 216
 #define DISP_CHECK_SIZE (DISP_CHECK_END - DISP_CHECK_START)
@@ -47,11 +61,58 @@ static uint64_t get_time_usec() {
 #include <fcntl.h>
 #endif
 
+#ifndef USE_SOUND
+#define USE_SOUND 1
+#endif
+
+// breakpoints and watchpoints
+#ifndef USE_DEBUG
+#define USE_DEBUG 1
+#endif
+
+// keeps a hash of the CPU state for search tools (see cpu_hash)
+#ifndef CPU_HASH
+#define CPU_HASH 0
+#endif
+
+// counts reads and writes of each memory nibble (see --memstats)
+#ifndef MEM_STATS
+#define MEM_STATS 0
+#endif
+
+#if MEM_STATS
+static uint64_t mem_reads[256], mem_writes[256];
+static int mem_on;
+#endif
+
+// builds a fuzz target instead of main (see LLVMFuzzerTestOneInput)
+#ifndef FUZZ
+#define FUZZ 0
+#endif
+
+#include <pthread.h>
+
 // to display memory map without flickering
 #ifndef NO_FLICKER
 #define NO_FLICKER 200
 #endif
 
+// decoded display state
+typedef struct {
+	uint16_t rows[20]; // bit 9 is the leftmost column
+	uint16_t next; // 4x4, row by row, bit 15 is the top left cell
+	uint8_t speed, level;
+	uint32_t score;
+	uint64_t flags; // bit N is disp_item[N]
+} disp_obs_t;
+
+// for external viewers, see README
+#define DISP_SHM_MAGIC 0x31444742 // "BGD1"
+typedef struct {
+	uint32_t magic, seq; // seq is odd while the writer updates the data
+	disp_obs_t obs;
+} disp_shm_t;
+
 typedef struct {
 	struct termios tcattr;
 #ifdef DECOMPILED
@@ -61,8 +122,14 @@ typedef struct {
 #endif
 #if NO_FLICKER
 	uint16_t memcopy[256];
+#endif
+	uint8_t memshown[256];
+	unsigned memmap_rate, memmap_count;
+#if MEM_STATS
+	uint64_t mem_last[256][2]; // reads and writes at the last map update
 #endif
 #if USE_GAMEPAD
+	const char *js_fn;
 	int js_fd;
 	uint32_t js_keys;
 	int js_axes, js_buttons;
@@ -73,6 +140,16 @@ typedef struct {
 	uint32_t misc;
 	uint32_t keys;
 	uint64_t key_timers[8];
+	pthread_t input_thread;
+	int input_pipe[2]; // stops the input thread
+	int wake_pipe[2]; // wakes the main thread when keys change
+	uint64_t input_time; // when the first change not yet sampled was read
+	uint32_t latency[24]; // log2 histogram in microseconds
+	int speed; // relative to 1x, from SPEED_MIN to SPEED_MAX
+	int focus; // the grid console getting the keys, 0 - all, modulo n + 1
+	uint64_t grid_bytes, grid_usec; // output of the grid mode
+	unsigned runahead; // time slices emulated ahead for the display
+	uint64_t run_usec, runahead_usec; // the cost of run-ahead
 	uint16_t old_rows[20];
 	uint32_t old_score;
 	uint16_t old_next, old_speed, old_level;
@@ -80,6 +157,13 @@ typedef struct {
 	uint8_t disp_mask[DISP_CHECK_SIZE];
 	uint16_t disp_pos[DISP_CHECK_SIZE][4];
 	char disp_buf[1024];
+	const char *shm_name;
+	disp_shm_t *shm;
+#if USE_SOUND
+	struct sound *snd;
+#endif
+	struct recorder *rec;
+	struct replay *replay_in, *replay_out;
 } sysctx_t;
 
 #if USE_GAMEPAD
@@ -88,18 +172,20 @@ typedef struct {
 #include <sys/ioctl.h>
 #include <fcntl.h>
 
-static void sys_gamepad_init(sysctx_t *sys) {
+// returns -1 if it's not a gamepad
+static int sys_gamepad_init(sysctx_t *sys) {
 	uint8_t axmap[ABS_CNT];
 	uint16_t btnmap[KEY_MAX - BTN_MISC + 1];
 	uint8_t buttons, axes;
 	int i;
 
-	if (ioctl(sys->js_fd, JSIOCGAXES, &axes) < 0)
-		ERR_EXIT("ioctl(JSIOCGAXES) failed\n");
-	if (ioctl(sys->js_fd, JSIOCGAXMAP, axmap) < 0)
-		ERR_EXIT("ioctl(JSIOCGAXMAP) failed\n");
+	if (ioctl(sys->js_fd, JSIOCGAXES, &axes) < 0) return -1;
+	if (ioctl(sys->js_fd, JSIOCGAXMAP, axmap) < 0) return -1;
+	if (ioctl(sys->js_fd, JSIOCGBUTTONS, &buttons) < 0) return -1;
+	if (ioctl(sys->js_fd, JSIOCGBTNMAP, btnmap) < 0) return -1;
 
 	sys->js_axes = axes;
+	free(sys->js_ax);
 	sys->js_ax = malloc(axes * sizeof(*sys->js_ax));
 	if (!sys->js_ax) ERR_EXIT("malloc failed\n");
 	memset(sys->js_ax, -1, axes * sizeof(*sys->js_ax));
@@ -115,12 +201,8 @@ static void sys_gamepad_init(sysctx_t *sys) {
 			break;
 		}
 
-	if (ioctl(sys->js_fd, JSIOCGBUTTONS, &buttons) < 0)
-		ERR_EXIT("ioctl(JSIOCGBUTTONS) failed\n");
-	if (ioctl(sys->js_fd, JSIOCGBTNMAP, btnmap) < 0)
-		ERR_EXIT("ioctl(JSIOCGBTNMAP) failed\n");
-
 	sys->js_buttons = buttons;
+	free(sys->js_btn);
 	sys->js_btn = malloc(buttons * sizeof(*sys->js_btn));
 	if (!sys->js_btn) ERR_EXIT("malloc failed\n");
 	memset(sys->js_btn, -1, buttons * sizeof(*sys->js_btn));
@@ -146,10 +228,23 @@ static void sys_gamepad_init(sysctx_t *sys) {
 			sys->js_btn[i] = 6; // on/off
 			break;
 		}
+	return 0;
+}
+
+// for hot-plugging, the input thread tries it again later if failed
+static void sys_gamepad_open(sysctx_t *sys) {
+	sys->js_fd = open(sys->js_fn, O_RDONLY);
+	if (sys->js_fd >= 0 && sys_gamepad_init(sys)) {
+		close(sys->js_fd);
+		sys->js_fd = -1;
+	}
 }
 
-static void sys_gamepad_events(sysctx_t *sys) {
+// returns 1 if the keys have changed
+static int sys_gamepad_events(sysctx_t *sys) {
 	struct js_event event;
+	// only this thread writes js_keys
+	uint32_t keys = __atomic_load_n(&sys->js_keys, __ATOMIC_RELAXED), old = keys;
 	struct pollfd fds = { 0 };
 	fds.fd = sys->js_fd;
 	fds.events = POLLIN;
@@ -157,8 +252,10 @@ static void sys_gamepad_events(sysctx_t *sys) {
 		int key, state;
 		int n = read(sys->js_fd, &event, sizeof(event));
 		if (n != sizeof(event)) {
+			// disconnected, release all keys
 			close(sys->js_fd);
 			sys->js_fd = -1;
+			keys = 0;
 			break;
 		}
 		key = -1;
@@ -176,46 +273,50 @@ static void sys_gamepad_events(sysctx_t *sys) {
 			int thr = 0x4000; // 0.5
 
 			mask = 1 << (key >> 4 & 15);
-			if (value <= -thr) sys->js_keys |= mask;
-			else sys->js_keys &= ~mask;
+			if (value <= -thr) keys |= mask;
+			else keys &= ~mask;
 
 			mask = 1 << (key & 15);
-			if (value >= thr) sys->js_keys |= mask;
-			else sys->js_keys &= ~mask;
+			if (value >= thr) keys |= mask;
+			else keys &= ~mask;
 
 		} else if (key == 17) { // memory map
 			if (event.value == 1) 
-				sys->js_keys ^= 1 << key;
+				keys ^= 1 << key;
 		} else if (event.value == 1) { // press
-			sys->js_keys |= 1 << key;
+			keys |= 1 << key;
 		} else if (event.value == 0) { // release
-			sys->js_keys &= ~(1 << key);
+			keys &= ~(1 << key);
 		}
 	}
+	__atomic_store_n(&sys->js_keys, keys, __ATOMIC_RELAXED);
+	return keys != old;
 }
 #endif
 
 static inline int sys_keys(sysctx_t *sys) {
+	int keys = __atomic_load_n(&sys->keys, __ATOMIC_RELAXED);
 #if USE_GAMEPAD
-	return sys->keys | sys->js_keys;
-#else
-	return sys->keys;
+	keys |= __atomic_load_n(&sys->js_keys, __ATOMIC_RELAXED);
 #endif
+	return keys;
 }
 
 // ps: start/pause, mute, on/off
 // pp: rotate, down, right, left
 
-static int sys_events(sysctx_t *sys) {
-	uint64_t time = get_time_usec();
-	unsigned hold_time = sys->hold_time * 1000;
-	int i;
-	for (i = 0; i < 8; i++)
-		if (time - sys->key_timers[i] > hold_time)
-			sys->keys &= ~(1 << i);
+// speed: 1/4, 1/2, 1, 2, 4, unlimited
+#define SPEED_MIN -2
+#define SPEED_MAX 3
+
+// Called by the input thread, returns 1 if the keys have changed
+// or -1 at the end of input.
+static int sys_input_read(sysctx_t *sys, uint64_t time) {
+	uint32_t set = 0, flip = 0;
+	int i, total = 0, speed = sys->speed, focus = sys->focus;
 
 #define SET_KEY(key) do { \
-	sys->keys |= 1 << key; \
+	set |= 1 << key; \
 	sys->key_timers[key] = time; \
 } while (0)
 
@@ -223,6 +324,8 @@ static int sys_events(sysctx_t *sys) {
 		int a, n, status = 0;
 		char buf[8];
 		n = read(0, &buf, sizeof(buf));
+		if (n <= 0 && !total) return -1;
+		total += n;
 		for (i = 0; i < n; i++) {
 			int key = -1;
 			a = buf[i];
@@ -237,7 +340,7 @@ static int sys_events(sysctx_t *sys) {
 			}
 			else if (a == 10) key = 4; // enter = start/pause
 			else if (a == 32) key = 0; // space = rotate
-			else if (a == 9) sys->keys ^= 1 << 17; // tab = memory map
+			else if (a == 9) flip ^= 1 << 17; // tab = memory map
 			else switch (a | 32) {
 			case 'w': key = 0; break; // w = up
 			case 'a': key = 3; break; // a = left
@@ -246,23 +349,166 @@ static int sys_events(sysctx_t *sys) {
 			case 'p': key = 4; break; // p = start/pause
 			case 'm': key = 5; break; // m = mute
 			case 'r': key = 6; break; // r = on/off
+			case '=': case '+': // faster
+				if (speed < SPEED_MAX) speed++;
+				break;
+			case '-': // slower
+				if (speed > SPEED_MIN) speed--;
+				break;
+			case ',': focus--; break; // previous grid console
+			case '.': focus++; break; // next grid console
+#if USE_DEBUG && !defined(DECOMPILED)
+			case 'b': set |= 1 << 18; break; // b = debugger
+#endif
 			default: status = 0;
 			}
 			if (key >= 0) SET_KEY(key);
 		}
 		if (n != sizeof(buf)) {
 			if (status == 1) // escape = exit
-				sys->keys |= 1 << 16;
+				set |= 1 << 16;
 			break;
 		}
 	}
 #undef SET_KEY
+	i = 0;
+	if (speed != sys->speed) {
+		__atomic_store_n(&sys->speed, speed, __ATOMIC_RELAXED);
+		i = 1;
+	}
+	if (focus != sys->focus) {
+		__atomic_store_n(&sys->focus, focus, __ATOMIC_RELAXED);
+		i = 1;
+	}
+	if (!(set | flip)) return i;
+	__atomic_fetch_or(&sys->keys, set, __ATOMIC_RELAXED);
+	__atomic_fetch_xor(&sys->keys, flip, __ATOMIC_RELAXED);
+	return 1;
+}
+
+static void sys_input_changed(sysctx_t *sys, uint64_t time) {
+	uint64_t zero = 0;
+	char c = 0;
+	__atomic_compare_exchange_n(&sys->input_time, &zero, time, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	if (write(sys->wake_pipe[1], &c, 1) < 0) {} // full is fine
+}
+
+// Reads the keyboard and the gamepad as soon as the events arrive,
+// releases keyboard keys after the hold time and reopens the gamepad.
+static void *sys_input_thread(void *arg) {
+	sysctx_t *sys = arg;
+	int stdin_eof = 0;
+#if USE_GAMEPAD
+	uint64_t js_retry = 0;
+#endif
+	for (;;) {
+		struct pollfd fds[3];
+		int i, n = 0, timeout = -1;
+		uint64_t time = get_time_usec();
+		uint32_t keys = __atomic_load_n(&sys->keys, __ATOMIC_RELAXED), clear = 0;
+		unsigned hold_time = sys->hold_time * 1000;
+
+		for (i = 0; i < 8; i++) if (keys >> i & 1) {
+			uint64_t t = time - sys->key_timers[i];
+			if (t > hold_time) clear |= 1 << i;
+			else {
+				int ms = (hold_time - t) / 1000 + 1;
+				if (timeout < 0 || ms < timeout) timeout = ms;
+			}
+		}
+		if (clear) {
+			__atomic_fetch_and(&sys->keys, ~clear, __ATOMIC_RELAXED);
+			sys_input_changed(sys, time);
+		}
+#if USE_GAMEPAD
+		if (sys->js_fd < 0 && sys->js_fn) {
+			if (time >= js_retry) {
+				js_retry = time + 1000000;
+				sys_gamepad_open(sys);
+			}
+			if (sys->js_fd < 0) {
+				int ms = (js_retry - time) / 1000 + 1;
+				if (timeout < 0 || ms < timeout) timeout = ms;
+			}
+		}
+#endif
+
+		fds[n].fd = sys->input_pipe[0]; fds[n++].events = POLLIN;
+		fds[n].fd = stdin_eof ? -1 : 0; fds[n++].events = POLLIN;
+#if USE_GAMEPAD
+		fds[n].fd = sys->js_fd; fds[n++].events = POLLIN;
+#endif
+		if (poll(fds, n, timeout) <= 0) continue;
+		if (fds[0].revents) break;
+		time = get_time_usec();
+		if (fds[1].revents) {
+			i = sys_input_read(sys, time);
+			if (i < 0) stdin_eof = 1;
+			else if (i) sys_input_changed(sys, time);
+		}
 #if USE_GAMEPAD
-	if (sys->js_fd >= 0) sys_gamepad_events(sys);
+		if (fds[2].revents && sys_gamepad_events(sys))
+			sys_input_changed(sys, time);
 #endif
+	}
+	return NULL;
+}
+
+static void sys_input_start(sysctx_t *sys) {
+	if (pipe(sys->input_pipe)) ERR_EXIT("pipe failed\n");
+	if (pthread_create(&sys->input_thread, NULL, sys_input_thread, sys))
+		ERR_EXIT("pthread_create failed\n");
+}
+
+static void sys_input_stop(sysctx_t *sys) {
+	char c = 0;
+	if (write(sys->input_pipe[1], &c, 1) != 1) ERR_EXIT("write failed\n");
+	pthread_join(sys->input_thread, NULL);
+	close(sys->input_pipe[0]);
+	close(sys->input_pipe[1]);
+}
+
+// samples the keys for the CPU
+static int sys_events(sysctx_t *sys) {
+	uint64_t t = __atomic_exchange_n(&sys->input_time, 0, __ATOMIC_RELAXED);
+	if (t) {
+		uint64_t lat = get_time_usec() - t;
+		int i = 0;
+		while (lat >> i && i < 23) i++;
+		sys->latency[i]++;
+	}
 	return sys_keys(sys);
 }
 
+// sleeps until the time passes or the keys change,
+// returns the time left in microseconds
+static unsigned sys_sleep(sysctx_t *sys, unsigned usec) {
+	uint64_t time = get_time_usec(), t;
+	struct timeval tv;
+	fd_set fds;
+	char buf[64];
+	FD_ZERO(&fds);
+	FD_SET(sys->wake_pipe[0], &fds);
+	tv.tv_sec = usec / 1000000;
+	tv.tv_usec = usec % 1000000;
+	if (select(sys->wake_pipe[0] + 1, &fds, NULL, NULL, &tv) <= 0) return 0;
+	while (read(sys->wake_pipe[0], buf, sizeof(buf)) == sizeof(buf));
+	t = get_time_usec() - time;
+	return t < usec ? usec - t : 0;
+}
+
+static void sys_latency_dump(sysctx_t *sys, const char *fn) {
+	FILE *f = fopen(fn, "w");
+	int i;
+	if (!f) ERR_EXIT("fopen failed\n");
+	fprintf(f, "# input latency, microseconds\n");
+	for (i = 0; i < 24; i++)
+		if (sys->latency[i])
+			fprintf(f, "< %8u  %u\n", 1u << i, sys->latency[i]);
+	fclose(f);
+}
+
 typedef struct {
 	uint8_t off, bit;
 	char row, col, empty;
@@ -306,17 +552,169 @@ static const disp_item_t disp_item[] = {
 	{ 0 }
 };
 
-static void sys_init(sysctx_t *sys) {
-	struct termios tcattr_new;
+static const uint16_t digit1[] = {
+	0x8c8c, 0x0880, 0x84c8, 0x88c8, 0x08c4,
+	0x884c, 0x8c4c, 0x0888, 0x8ccc, 0x88cc };
+static const uint8_t digit4[] = {
+	0xe7, 0xa0, 0xcb, 0xe9, 0xac, 0x6d, 0x6f, 0xe0, 0xef, 0xed };
 
-	memset(sys, 0, sizeof(*sys));
+// reverse tables, digit + 1 or zero
+static uint8_t digit1_tab[128], digit4_tab[256];
 
-	tcgetattr(0, &sys->tcattr);
-	tcattr_new = sys->tcattr;
+#define DIGIT1_IDX(a) (((a) >> 9 & 0x40) | ((a) >> 6 & 0x30) | ((a) >> 4 & 12) | ((a) >> 2 & 3))
+
+static void disp_init(void) {
+	int j;
+	if (digit4_tab[digit4[0]]) return;
+	for (j = 0; j < 10; j++) {
+		digit1_tab[DIGIT1_IDX(digit1[j])] = j + 1;
+		digit4_tab[digit4[j]] = j + 1;
+	}
+}
+
+// returns the digit or -1 for an empty or unknown one,
+// disp_init() must be called before
+static int disp_digit1(unsigned a) {
+	return digit1_tab[DIGIT1_IDX(a & 0x8ccc)] - 1;
+}
+
+static int disp_digit4(unsigned a) {
+	return digit4_tab[a & 0xef] - 1;
+}
+
+// playfield rows, bit 9 is the leftmost column
+static void disp_rows(const uint8_t *mem, uint16_t *rows) {
+	// columns 0 and 1 are scattered over the rest of the display memory
+	static const uint8_t tab[4][20] = {
+		{ 194,194,194,194, 196,198,200,202,204,206,208,210, 214,214,214,214, 215,215,215,215 },
+		{ 3,0,2,1, 0,0,0,0,0,0,0,0, 2,0,1,3, 0,1,3,2 },
+		{ 192,192,192,192, 196,198,200,202,204,206,208,210, 212,212,212,212, 213,213,213,213 },
+		{ 3,0,2,1, 1,1,1,1,1,1,1,1, 2,0,1,3, 0,1,3,2 } };
+	int i;
+	for (i = 0; i < 20; i++)
+		rows[i] = mem[217 + i * 2] << 6 | mem[216 + i * 2] << 2 |
+				(mem[tab[0][i]] >> tab[1][i] & 1) << 1 |
+				(mem[tab[2][i]] >> tab[3][i] & 1);
+}
+
+static unsigned disp_next(const uint8_t *mem) {
+	unsigned a = mem[184] | mem[186] << 4 | mem[188] << 8 | mem[190] << 12;
+	unsigned i, j, x = 0;
+	for (i = 0; i < 4; i++)
+		for (j = 0; j < 4; j++)
+			x = x << 1 | (a >> ((0x1203 >> (i * 4) & 3) + 12 - j * 4) & 1);
+	return x;
+}
+
+// score digits, the first digit is in the low byte
+static uint32_t disp_score4(const uint8_t *mem) {
+	uint32_t a;
+	a  = (mem[179] | mem[199] << 4) << 24;
+	a |= (mem[185] | mem[201] << 4) << 16;
+	a |= (mem[189] | mem[187] << 4) << 8;
+	a |=  mem[191] | mem[203] << 4;
+	return a & 0xefefefef;
+}
+
+static uint32_t disp_score(const uint8_t *mem) {
+	uint32_t score = mem[193] >> 3 & 1, a = disp_score4(mem);
+	int i;
+	// displayed as "1dddd00", empty digits are zeros
+	for (i = 0; i < 4; i++, a >>= 8) {
+		int d = disp_digit4(a);
+		score = score * 10 + (d < 0 ? 0 : d);
+	}
+	return score * 100;
+}
+
+// speed (off = 196) or level (off = 204), 0..19
+static unsigned disp_num(const uint8_t *mem, int off) {
+	unsigned a = mem[off] | mem[off + 2] << 4 | mem[off + 4] << 8 | mem[off + 6] << 12;
+	int x = disp_digit1(a);
+	return (x < 0 ? 0 : x) + (a >> 14 & 1) * 10;
+}
+
+static uint64_t disp_flags(const uint8_t *mem) {
+	const disp_item_t *item = disp_item;
+	uint64_t flags = 0;
+	int i;
+	for (i = 0; item->str; item++, i++)
+		flags |= (uint64_t)(mem[item->off] >> item->bit & 1) << i;
+	return flags;
+}
+
+// Decodes the display of n instances, their memory arrays
+// are located at mem + stride * i, disp_init() must be called before.
+static void disp_observe(const uint8_t *mem, size_t stride,
+		unsigned n, disp_obs_t *out) {
+	for (; n; n--, mem += stride, out++) {
+		disp_rows(mem, out->rows);
+		out->next = disp_next(mem);
+		out->speed = disp_num(mem, 196);
+		out->level = disp_num(mem, 204);
+		out->score = disp_score(mem);
+		out->flags = disp_flags(mem);
+	}
+}
+
+static void sys_shm_init(sysctx_t *sys, const char *name) {
+	disp_shm_t *shm;
+	int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) ERR_EXIT("shm_open failed\n");
+	if (ftruncate(fd, sizeof(*shm))) ERR_EXIT("ftruncate failed\n");
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) ERR_EXIT("mmap failed\n");
+	memset(shm, 0, sizeof(*shm));
+	shm->magic = DISP_SHM_MAGIC;
+	sys->shm_name = name;
+	sys->shm = shm;
+}
+
+static void sys_shm_close(sysctx_t *sys) {
+	if (!sys->shm) return;
+	munmap(sys->shm, sizeof(*sys->shm));
+	shm_unlink(sys->shm_name);
+	sys->shm = NULL;
+}
+
+static void sys_shm_update(sysctx_t *sys, const uint8_t *mem) {
+	disp_shm_t *shm = sys->shm;
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	disp_observe(mem, 0, 1, &shm->obs);
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void sys_raw(sysctx_t *sys) {
+	struct termios tcattr_new = sys->tcattr;
 	tcattr_new.c_lflag &= ~(ICANON|ECHO);
 	tcattr_new.c_cc[VMIN] = 0;
 	tcattr_new.c_cc[VTIME] = 0;
 	tcsetattr(0, TCSANOW, &tcattr_new);
+}
+
+// clears the screen, sys_redraw() will draw everything again
+static void sys_repaint(sysctx_t *sys) {
+	int y = 3;
+	printf("\33[2J\33[?25l"); // clear screen, hide cursor
+	printf("\33[%uH/--------------------\\", y++);
+	for (; y <= 3 + 20; y++)
+		printf("\33[%uH|                    |", y);
+	printf("\33[%uH\\--------------------/", y);
+	printf("\33[H\n"); // refresh screen
+	memset(sys->old_mem, 0, sizeof(sys->old_mem));
+	memset(sys->old_rows, 0, sizeof(sys->old_rows));
+	sys->old_score = 0;
+	sys->old_next = sys->old_speed = sys->old_level = 0;
+	sys->misc &= ~1;
+}
+
+static void sys_init(sysctx_t *sys) {
+	disp_init();
+
+	tcgetattr(0, &sys->tcattr);
+	sys_raw(sys);
 
 	{
 		uint64_t time = get_time_usec();
@@ -324,15 +722,12 @@ static void sys_init(sysctx_t *sys) {
 		for (i = 0; i < 7; i++) sys->key_timers[i] = time;
 	}
 
-	printf("\33[2J\33[?25l"); // clear screen, hide cursor
-	{
-		int y = 3;
-		printf("\33[%uH/--------------------\\", y++);
-		for (; y <= 3 + 20; y++)
-			printf("\33[%uH|                    |", y);
-		printf("\33[%uH\\--------------------/", y);
-		printf("\33[H\n"); // refresh screen
-	}
+	sys_repaint(sys);
+
+	if (pipe(sys->wake_pipe)) ERR_EXIT("pipe failed\n");
+	fcntl(sys->wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(sys->wake_pipe[1], F_SETFL, O_NONBLOCK);
+	sys_input_start(sys);
 
 	{
 		int n = sizeof(sys->disp_buf);
@@ -362,8 +757,13 @@ static void sys_init(sysctx_t *sys) {
 }
 
 static void sys_close(sysctx_t *sys) {
+	sys_input_stop(sys);
+	close(sys->wake_pipe[0]);
+	close(sys->wake_pipe[1]);
+	sys_shm_close(sys);
 	tcsetattr(0, TCSANOW, &sys->tcattr);
 	printf("\33[m\33[2J\33[?25h\33[H"); // show cursor
+	fflush(stdout);
 #if USE_GAMEPAD
 	if (sys->js_fd >= 0) close(sys->js_fd);
 	if (sys->js_ax) free(sys->js_ax);
@@ -372,12 +772,14 @@ static void sys_close(sysctx_t *sys) {
 }
 
 static void sys_redraw(sysctx_t *sys, uint8_t *mem) {
-	int i, j;
+	int i, j, changed = 0;
+	uint16_t rows[20];
 	for (i = 0; i < DISP_CHECK_SIZE; i++) {
 		int val = mem[i + DISP_CHECK_START];
 		int diff = sys->old_mem[i] ^ val;
 		if (diff) {
 			sys->old_mem[i] = val;
+			changed |= sys->disp_mask[i] & diff;
 			if (sys->disp_mask[i] & diff)
 			for (j = 0; j < 4; j++)
 			if (diff & 1 << j) {
@@ -390,27 +792,13 @@ static void sys_redraw(sysctx_t *sys, uint8_t *mem) {
 		}
 	}
 
+	disp_rows(mem, rows);
 	for (i = 0; i < 20; i++) {
-		int a, x;
-		a = mem[217 + i * 2] << 4 | mem[216 + i * 2];
-		if ((unsigned)(i - 4) < 8) {
-			x = mem[196 + i * 2 - 8] & 3;
-			x = (x << 1 | x >> 1) & 3;
-		} else {
-			const uint8_t tab[20 * 2] = {
-				192,3, 192,0, 192,2, 192,1,
-				0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
-				212,2, 212,0, 212,1, 212,3,
-				213,0, 213,1, 213,3, 213,2
-			};
-			int off = tab[i * 2], bit = tab[i * 2 + 1];
-			x = mem[off + 2] >> bit & 1;
-			x = x << 1 | (mem[off] >> bit & 1);
-		}
-		a = a << 2 | x;
+		int a = rows[i];
 		if (sys->old_rows[i] != a) {
 			char buf[20], *d = buf;
 			sys->old_rows[i] = a;
+			changed = 1;
 			for (j = 0; j < 10; j++, a <<= 1, d += 2) {
 				if (a & 0x200) d[0] = '[', d[1] = ']';
 				else d[0] = ' ', d[1] = ' ';
@@ -421,17 +809,16 @@ static void sys_redraw(sysctx_t *sys, uint8_t *mem) {
 
 	// update next
 	{
-		int a = mem[184] | mem[186] << 4 | mem[188] << 8 | mem[190] << 12;
-		int diff = a ^ sys->old_next;
+		int a = disp_next(mem), diff = a ^ sys->old_next;
 		if (diff) {
 			sys->old_next = a;
+			changed = 1;
 			for (i = 0; i < 4; i++) {
-				char buf[8], *d;
-				int x, sh = 0x1203 >> (i * 4) & 3;
-				if (!(diff >> sh & 0x1111)) continue;
-				x = a >> sh; d = buf;
-				for (j = 0; j < 4; j++, x <<= 4, d += 2) {
-					if (x & 0x1000) d[0] = '[', d[1] = ']';
+				char buf[8], *d = buf;
+				int x = a >> (12 - i * 4);
+				if (!(diff >> (12 - i * 4) & 15)) continue;
+				for (j = 0; j < 4; j++, x <<= 1, d += 2) {
+					if (x & 8) d[0] = '[', d[1] = ']';
 					else d[0] = ' ', d[1] = ' ';
 				}
 				printf("\33[%u;24H%.8s", i + 6, buf);
@@ -440,42 +827,36 @@ static void sys_redraw(sysctx_t *sys, uint8_t *mem) {
 	}
 	{
 		int a;
-		static const uint16_t digit1[] = {
-			0x8c8c, 0x0880, 0x84c8, 0x88c8, 0x08c4,
-			0x884c, 0x8c4c, 0x0888, 0x8ccc, 0x88cc };
 		// update speed
 		a = mem[196] | mem[198] << 4 | mem[200] << 8 | mem[202] << 12;
 		a &= 0x8ccc;
 		if (a != sys->old_speed) {
 			sys->old_speed = a;
-			for (j = 0; j < 10; j++) if (a == digit1[j]) break;
-			printf("\33[11;31H%c", j < 10 ? j + '0' : a ? '?' : ' ');
+			changed = 1;
+			j = disp_digit1(a);
+			printf("\33[11;31H%c", j >= 0 ? j + '0' : a ? '?' : ' ');
 		}
 		// update level
 		a = mem[204] | mem[206] << 4 | mem[208] << 8 | mem[210] << 12;
 		a &= 0x8ccc;
 		if (a != sys->old_level) {
 			sys->old_level = a;
-			for (j = 0; j < 10; j++) if (a == digit1[j]) break;
-			printf("\33[13;31H%c", j < 10 ? j + '0' : a ? '?' : ' ');
+			changed = 1;
+			j = disp_digit1(a);
+			printf("\33[13;31H%c", j >= 0 ? j + '0' : a ? '?' : ' ');
 		}
 	}
 	// update score
 	{
-		char buf[4]; uint32_t a;
-		static const uint8_t digit4[] = {
-			0xe7, 0xa0, 0xcb, 0xe9, 0xac, 0x6d, 0x6f, 0xe0, 0xef, 0xed };
-		a  = (mem[179] | mem[199] << 4) << 24;
-		a |= (mem[185] | mem[201] << 4) << 16;
-		a |= (mem[189] | mem[187] << 4) << 8;
-		a |=  mem[191] | mem[203] << 4;
-		a &= 0xefefefef;
+		char buf[4];
+		uint32_t a = disp_score4(mem);
 		if (a != sys->old_score) {
 			sys->old_score = a;
+			changed = 1;
 			for (i = 0; i < 4; i++, a >>= 8) {
 				int x = a & 0xff;
-				for (j = 0; j < 10; j++) if (x == digit4[j]) break;
-				buf[i] = j < 10 ? j + '0' : x ? '?' : ' ';
+				j = disp_digit4(x);
+				buf[i] = j >= 0 ? j + '0' : x ? '?' : ' ';
 			}
 			printf("\33[1;26H%.4s", buf);
 		}
@@ -485,31 +866,68 @@ static void sys_redraw(sysctx_t *sys, uint8_t *mem) {
 		int i, j;
 		int row = 3;
 		if (sys_keys(sys) >> 17 & 1) {
-			char buf[32];
+			uint8_t glyph[256];
 			if (!(sys->misc & 1)) {
 				printf("\33[%u;40H    0 1 2 3 4 5 6 7 8 9 a b c d e f", row);
 				printf("\33[%u;40H  /--------------------------------", row + 1);
 				for (i = 0; i < 16; i++)
 					printf("\33[%u;40H%x |", i + row + 2, i);
 				sys->misc |= 1;
+				memset(sys->memshown, -1, sizeof(sys->memshown));
 #if NO_FLICKER
 				memset(sys->memcopy, 0, sizeof(sys->memcopy));
 #endif
 			}
-			for (i = 0; i < 16; i++) {
-				for (j = 0; j < 16; j++) {
-					int a = mem[i << 4 | j];
+#if MEM_STATS
+			if (mem_on) {
+				// heat: 0 - no access, 1-2 - read, 3-4 - written,
+				// since the last update of the map
+				if (sys->memmap_count + 1 >= sys->memmap_rate)
+				for (i = 0; i < 256; i++) {
+					uint64_t *last = sys->mem_last[i];
+					unsigned r = mem_reads[i] - last[0], w = mem_writes[i] - last[1];
+					last[0] = mem_reads[i]; last[1] = mem_writes[i];
+					glyph[i] = mem[i];
+					if (r | w) glyph[i] |= ((w ? 3 : 1) + (r + w >= 16)) << 4;
+				}
+			} else
+#endif
 #if NO_FLICKER
-					int b = sys->memcopy[i << 4 | j];
-					int thr = NO_FLICKER * 16;
-					if ((a ^ b) & 15) b = a;
-					if (b < thr) b += 0x10, a = 0x10;
-					sys->memcopy[i << 4 | j] = b;
-#endif
-					buf[j * 2] = a > 15 ? '#' : a < 10 ? a + '0' : a - 10 + 'a';
-					buf[j * 2 + 1] = ' ';
+			// no branches, so the compiler can vectorize it
+			for (i = 0; i < 256; i++) {
+				unsigned a = mem[i], b = sys->memcopy[i], hot;
+				b = (a ^ b) & 15 ? a : b;
+				hot = b < NO_FLICKER * 16;
+				sys->memcopy[i] = b + (hot << 4);
+				glyph[i] = hot ? 16 : a;
+			}
+#else
+			memcpy(glyph, mem, sizeof(glyph));
+#endif
+			if (++sys->memmap_count >= sys->memmap_rate) {
+				sys->memmap_count = 0;
+				// only the changed cells, a run of them with one cursor move
+				for (i = 0; i < 256; i++) {
+					char buf[16 * 10], *d = buf;
+					if (glyph[i] == sys->memshown[i]) continue;
+					j = i;
+					do {
+						int a = sys->memshown[j] = glyph[j];
+#if MEM_STATS
+						// background colors: none, blue, cyan, yellow, red
+						static const uint8_t heat_bg[] = { 49, 44, 46, 43, 41 };
+						if (mem_on) {
+							d += sprintf(d, "\33[%um%x\33[m ", heat_bg[a >> 4], a & 15);
+							continue;
+						}
+#endif
+						*d++ = a > 15 ? '#' : a < 10 ? a + '0' : a - 10 + 'a';
+						*d++ = ' ';
+					} while (++j & 15 && glyph[j] != sys->memshown[j]);
+					printf("\33[%u;%uH%.*s", (i >> 4) + row + 2,
+							44 + (i & 15) * 2, (int)(d - buf - 1), buf);
+					i = j - 1;
 				}
-				printf("\33[%u;44H%.31s", i + row + 2, buf);
 			}
 		} else if (sys->misc & 1) {
 			sys->misc &= ~1;
@@ -519,6 +937,436 @@ static void sys_redraw(sysctx_t *sys, uint8_t *mem) {
 		}
 	}
 	printf("\33[H\n"); // refresh screen
+	if (changed && sys->shm) sys_shm_update(sys, mem);
+}
+
+// single producer, single consumer, size is a power of two
+typedef struct {
+	uint8_t *buf;
+	uint32_t size, head, tail;
+} ring_t;
+
+static void ring_init(ring_t *r, uint32_t size) {
+	r->buf = malloc(size);
+	if (!r->buf) ERR_EXIT("malloc failed\n");
+	r->size = size;
+	r->head = r->tail = 0;
+}
+
+// returns the number of bytes written
+static uint32_t ring_write(ring_t *r, const void *src, uint32_t n) {
+	uint32_t head = r->head, i = head & (r->size - 1), k;
+	uint32_t avail = r->size - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+	if (n > avail) n = avail;
+	k = r->size - i; if (k > n) k = n;
+	memcpy(r->buf + i, src, k);
+	memcpy(r->buf, (const uint8_t*)src + k, n - k);
+	__atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+// for the writer
+static uint32_t ring_free(ring_t *r) {
+	return r->size - (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+}
+
+static uint32_t ring_read(ring_t *r, void *dst, uint32_t n) {
+	uint32_t tail = r->tail, i = tail & (r->size - 1), k;
+	uint32_t avail = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+	if (n > avail) n = avail;
+	k = r->size - i; if (k > n) k = n;
+	memcpy(dst, r->buf + i, k);
+	memcpy((uint8_t*)dst + k, r->buf, n - k);
+	__atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+	return n;
+}
+
+#if USE_SOUND
+#define SOUND_RATE 22050
+// emulated ticks per second
+#define SOUND_TICK_RATE 1000000
+#define SOUND_BEEP (SOUND_RATE / 8)
+
+// The sound ROM of the chip is not dumped, so each sound number
+// is played as a square wave beep of its own pitch.
+typedef struct sound {
+	ring_t ring;
+	pthread_t thread;
+	FILE *wav, *pipe;
+	uint32_t wav_size, frac, phase, pos;
+	uint8_t num, mode, starts;
+	int stop; // __atomic
+} sound_t;
+
+static void sound_wav_header(FILE *f, uint32_t size) {
+	uint8_t h[44];
+	static const uint32_t v[] = {
+		0x46464952, 0, 0x45564157, 0x20746d66, 16, 0x10001,
+		SOUND_RATE, SOUND_RATE * 2, 0x100002, 0x61746164, 0 };
+	int i;
+	for (i = 0; i < 11; i++) {
+		uint32_t x = v[i];
+		if (i == 1) x = size + 36;
+		if (i == 10) x = size;
+		h[i * 4] = x; h[i * 4 + 1] = x >> 8;
+		h[i * 4 + 2] = x >> 16; h[i * 4 + 3] = x >> 24;
+	}
+	fwrite(h, 1, sizeof(h), f);
+}
+
+static void *sound_thread(void *arg) {
+	sound_t *snd = arg;
+	uint8_t buf[4096];
+	for (;;) {
+		uint32_t n = ring_read(&snd->ring, buf, sizeof(buf));
+		if (!n) {
+			if (__atomic_load_n(&snd->stop, __ATOMIC_ACQUIRE)) break;
+			usleep(5000);
+			continue;
+		}
+		if (snd->wav) snd->wav_size += fwrite(buf, 1, n, snd->wav);
+		if (snd->pipe) {
+			fwrite(buf, 1, n, snd->pipe);
+			fflush(snd->pipe);
+		}
+	}
+	return NULL;
+}
+
+static void sound_init(sound_t *snd, const char *wav_fn, const char *pipe_cmd) {
+	memset(snd, 0, sizeof(*snd));
+	if (wav_fn) {
+		snd->wav = fopen(wav_fn, "wb");
+		if (!snd->wav) ERR_EXIT("fopen failed\n");
+		sound_wav_header(snd->wav, 0);
+	}
+	if (pipe_cmd) {
+		signal(SIGPIPE, SIG_IGN);
+		snd->pipe = popen(pipe_cmd, "w");
+		if (!snd->pipe) ERR_EXIT("popen failed\n");
+	}
+	ring_init(&snd->ring, 1 << 17);
+	if (pthread_create(&snd->thread, NULL, sound_thread, snd))
+		ERR_EXIT("pthread_create failed\n");
+}
+
+static void sound_close(sound_t *snd) {
+	__atomic_store_n(&snd->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(snd->thread, NULL);
+	if (snd->wav) {
+		fseek(snd->wav, 0, SEEK_SET);
+		sound_wav_header(snd->wav, snd->wav_size);
+		fclose(snd->wav);
+	}
+	if (snd->pipe) pclose(snd->pipe);
+	free(snd->ring.buf);
+}
+
+// mode: 0 - off, 1 - once, 2 - loop; starts is incremented on every start
+static void sound_render(sound_t *snd, unsigned num, unsigned mode,
+		unsigned starts, uint32_t ticks) {
+	int16_t buf[256];
+	uint32_t i, n, step;
+
+	if ((uint8_t)starts != snd->starts)
+		snd->starts = starts, snd->pos = 0;
+	snd->num = num; snd->mode = mode;
+	// 523 Hz (C5) and up by semitones, as 32-bit phase steps
+	step = (uint32_t)(523.25 * 4294967296.0 / SOUND_RATE);
+	for (i = 0; i < num; i++) step += step / 17; // about a semitone
+
+	n = (uint64_t)(snd->frac + (uint64_t)ticks * SOUND_RATE) / SOUND_TICK_RATE;
+	snd->frac = (snd->frac + (uint64_t)ticks * SOUND_RATE) % SOUND_TICK_RATE;
+	while (n) {
+		uint32_t k = n < 256 ? n : 256;
+		if (!mode) memset(buf, 0, k * 2);
+		else for (i = 0; i < k; i++) {
+			uint32_t pos = snd->pos++;
+			int on = mode == 1 ? pos < SOUND_BEEP : pos % (SOUND_BEEP * 2) < SOUND_BEEP;
+			snd->phase += step;
+			buf[i] = on ? (int32_t)snd->phase < 0 ? 6000 : -6000 : 0;
+		}
+		// drops samples if the output can't keep up
+		ring_write(&snd->ring, buf, k * 2);
+		n -= k;
+	}
+}
+#endif
+
+// Records the decoded display to asciicast v2 or GIF (by the file name),
+// an encoder thread reads the frames from a ring buffer.
+
+#define REC_W 40 // asciicast screen
+#define REC_H 24
+#define GIF_W 160
+#define GIF_H 176
+#define GIF_CELL 8
+
+typedef struct {
+	uint64_t time; // microseconds from the start
+	disp_obs_t obs;
+} rec_frame_t;
+
+typedef struct recorder {
+	ring_t ring;
+	pthread_t thread;
+	FILE *f;
+	int gif, queued;
+	uint64_t start;
+	disp_obs_t last;
+	uint32_t frames, dropped;
+	int stop; // __atomic
+	// encoder state
+	rec_frame_t prev;
+	int have_prev;
+	uint64_t gif_time; // the delays written so far, in microseconds
+	uint16_t lzw[4096][4];
+	uint8_t pix[GIF_W * GIF_H];
+} recorder_t;
+
+static void rec_text(const disp_obs_t *obs, char (*scr)[REC_W]) {
+	const disp_item_t *item = disp_item;
+	int i, j;
+	memset(scr, ' ', REC_H * REC_W);
+	memcpy(&scr[2][0], "/--------------------\\", 22);
+	memcpy(&scr[23][0], "\\--------------------/", 22);
+	for (i = 0; i < 20; i++) {
+		scr[i + 3][0] = scr[i + 3][21] = '|';
+		for (j = 0; j < 10; j++)
+			if (obs->rows[i] << j & 0x200)
+				scr[i + 3][j * 2 + 1] = '[', scr[i + 3][j * 2 + 2] = ']';
+	}
+	for (i = 0; i < 16; i++)
+		if (obs->next << i & 0x8000)
+			scr[(i >> 2) + 5][(i & 3) * 2 + 23] = '[',
+			scr[(i >> 2) + 5][(i & 3) * 2 + 24] = ']';
+	// the digits are printed from the numbers
+	for (i = 0; item->str; item++, i++) {
+		int n = strlen(item->str);
+		if (!(obs->flags >> i & 1) || (item->str[0] >= '0' && item->str[0] <= '9'))
+			continue;
+		if (item->col - 1 + n > REC_W) n = REC_W - item->col + 1;
+		memcpy(&scr[item->row - 1][item->col - 1], item->str, n);
+	}
+	{
+		char buf[16];
+		snprintf(buf, sizeof(buf), "%7u", obs->score % 10000000);
+		memcpy(&scr[0][24], buf, 7);
+		snprintf(buf, sizeof(buf), "%2u", obs->speed % 100);
+		memcpy(&scr[10][29], buf, 2);
+		snprintf(buf, sizeof(buf), "%2u", obs->level % 100);
+		memcpy(&scr[12][29], buf, 2);
+	}
+}
+
+static void rec_cast_frame(recorder_t *rec, const rec_frame_t *fr) {
+	char scr[REC_H][REC_W];
+	int i, j, n;
+	rec_text(&fr->obs, scr);
+	fprintf(rec->f, "[%.6f, \"o\", \"\\u001b[H", fr->time * 1e-6);
+	for (i = 0; i < REC_H; i++) {
+		for (n = REC_W; n && scr[i][n - 1] == ' '; n--);
+		for (j = 0; j < n; j++) {
+			if (scr[i][j] == '\\') fputc('\\', rec->f);
+			fputc(scr[i][j], rec->f);
+		}
+		fputs(i < REC_H - 1 ? "\\u001b[K\\r\\n" : "\\u001b[K", rec->f);
+	}
+	fputs("\"]\n", rec->f);
+}
+
+// 3x5 digits for the GIF
+static const uint16_t rec_font[10] = {
+	0x7b6f, 0x2c97, 0x73e7, 0x73cf, 0x5bc9,
+	0x79cf, 0x79ef, 0x7249, 0x7bef, 0x7bcf };
+
+static void gif_rect(uint8_t *pix, int x, int y, int w, int h, int color) {
+	for (; h; h--, y++) memset(pix + y * GIF_W + x, color, w);
+}
+
+static void gif_cell(uint8_t *pix, int x, int y, int on) {
+	gif_rect(pix, x, y, GIF_CELL - 1, GIF_CELL - 1, on ? 1 : 2);
+	if (on) gif_rect(pix, x + 2, y + 2, GIF_CELL - 5, GIF_CELL - 5, 0);
+}
+
+static void gif_number(uint8_t *pix, int x, int y, unsigned val, int digits) {
+	for (x += digits * 8; digits--; val /= 10) {
+		unsigned a = rec_font[val % 10], i;
+		x -= 8;
+		for (i = 0; i < 15; i++)
+			if (a << i & 0x4000)
+				gif_rect(pix, x + i % 3 * 2, y + i / 3 * 2, 2, 2, 1);
+		if (val < 10) break;
+	}
+}
+
+// LSB-first codes in sub-blocks of up to 255 bytes
+typedef struct {
+	FILE *f;
+	uint32_t acc;
+	int bits, n;
+	uint8_t buf[255];
+} gif_bits_t;
+
+static void gif_put(gif_bits_t *b, unsigned code, int size) {
+	b->acc |= code << b->bits;
+	for (b->bits += size; b->bits >= 8; b->bits -= 8, b->acc >>= 8) {
+		b->buf[b->n++] = b->acc;
+		if (b->n == 255) {
+			fputc(255, b->f); fwrite(b->buf, 1, 255, b->f);
+			b->n = 0;
+		}
+	}
+}
+
+// 4 colors: 2-bit minimum code size, clear = 4, end = 5
+static void gif_lzw(recorder_t *rec) {
+	gif_bits_t b;
+	unsigned cur = rec->pix[0], avail = 6, size = 3, i;
+	b.f = rec->f; b.acc = 0; b.bits = b.n = 0;
+	memset(rec->lzw, 0, sizeof(rec->lzw));
+	fputc(2, rec->f);
+	gif_put(&b, 4, size);
+	for (i = 1; i < GIF_W * GIF_H; i++) {
+		unsigned k = rec->pix[i];
+		if (rec->lzw[cur][k]) { cur = rec->lzw[cur][k]; continue; }
+		gif_put(&b, cur, size);
+		if (avail < 4096) {
+			if (avail == 1u << size) size++;
+			rec->lzw[cur][k] = avail++;
+		} else {
+			gif_put(&b, 4, size);
+			memset(rec->lzw, 0, sizeof(rec->lzw));
+			avail = 6; size = 3;
+		}
+		cur = k;
+	}
+	gif_put(&b, cur, size);
+	// the decoder adds an entry after the last code too
+	if (avail < 4096 && avail == 1u << size) size++;
+	gif_put(&b, 5, size);
+	if (b.bits) gif_put(&b, 0, 8 - b.bits);
+	if (b.n) { fputc(b.n, b.f); fwrite(b.buf, 1, b.n, b.f); }
+	fputc(0, rec->f);
+}
+
+// the previous frame is written when the next one comes, with its duration
+static void rec_gif_frame(recorder_t *rec, const rec_frame_t *fr, uint64_t end) {
+	const disp_obs_t *obs = &fr->obs;
+	uint8_t *pix = rec->pix;
+	unsigned delay;
+	int i, j;
+
+	memset(pix, 0, sizeof(rec->pix));
+	gif_rect(pix, 3, 3, 10 * GIF_CELL + 3, 20 * GIF_CELL + 3, 1);
+	gif_rect(pix, 4, 4, 10 * GIF_CELL + 1, 20 * GIF_CELL + 1, 0);
+	for (i = 0; i < 20; i++)
+		for (j = 0; j < 10; j++)
+			gif_cell(pix, 5 + j * GIF_CELL, 5 + i * GIF_CELL, obs->rows[i] << j & 0x200);
+	for (i = 0; i < 16; i++)
+		gif_cell(pix, 96 + (i & 3) * GIF_CELL, 8 + (i >> 2) * GIF_CELL, obs->next << i & 0x8000);
+	gif_number(pix, 96, 56, obs->score, 7);
+	gif_number(pix, 96, 76, obs->speed, 2);
+	gif_number(pix, 96, 96, obs->level, 2);
+	if (obs->flags & 1) gif_rect(pix, 96, 116, 56, 4, 1); // game over
+
+	// in 1/100 s, rounded so that the total time stays right
+	delay = (end - rec->gif_time + 5000) / 10000;
+	rec->gif_time += delay * 10000;
+	{
+		static const uint8_t gce[] = { 0x21, 0xf9, 4, 0 };
+		uint8_t desc[10] = { 0x2c, 0, 0, 0, 0,
+			GIF_W & 255, GIF_W >> 8, GIF_H & 255, GIF_H >> 8, 0 };
+		fwrite(gce, 1, sizeof(gce), rec->f);
+		fputc(delay & 255, rec->f); fputc(delay >> 8, rec->f);
+		fputc(0, rec->f); fputc(0, rec->f);
+		fwrite(desc, 1, sizeof(desc), rec->f);
+	}
+	gif_lzw(rec);
+}
+
+static void rec_write(recorder_t *rec, const rec_frame_t *fr) {
+	if (!rec->gif) { rec_cast_frame(rec, fr); return; }
+	// a frame that comes less than 2/100 s (the shortest delay for viewers)
+	// after the last written one replaces the previous frame, which is dropped
+	if (!rec->have_prev) rec->gif_time = fr->time;
+	else if ((int64_t)(fr->time - rec->gif_time) >= 20000)
+		rec_gif_frame(rec, &rec->prev, fr->time);
+	rec->prev = *fr;
+	rec->have_prev = 1;
+}
+
+static void *rec_thread(void *arg) {
+	recorder_t *rec = arg;
+	rec_frame_t fr;
+	for (;;) {
+		if (!ring_read(&rec->ring, &fr, sizeof(fr))) {
+			if (__atomic_load_n(&rec->stop, __ATOMIC_ACQUIRE)) break;
+			usleep(10000);
+			continue;
+		}
+		rec_write(rec, &fr);
+	}
+	return NULL;
+}
+
+static void rec_init(recorder_t *rec, const char *fn) {
+	size_t len = strlen(fn);
+	memset(rec, 0, sizeof(*rec));
+	rec->gif = len >= 4 && !strcmp(fn + len - 4, ".gif");
+	rec->f = fopen(fn, "wb");
+	if (!rec->f) ERR_EXIT("fopen failed\n");
+	if (rec->gif) {
+		static const uint8_t head[] = {
+			'G', 'I', 'F', '8', '9', 'a',
+			GIF_W & 255, GIF_W >> 8, GIF_H & 255, GIF_H >> 8, 0x81, 0, 0,
+			// LCD background, dark cell, light cell, unused
+			0x9e, 0xad, 0x86, 0x1e, 0x24, 0x14, 0x8e, 0x9b, 0x78, 0, 0, 0,
+			// NETSCAPE2.0, loop forever
+			0x21, 0xff, 11, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E',
+			'2', '.', '0', 3, 1, 0, 0, 0 };
+		fwrite(head, 1, sizeof(head), rec->f);
+	} else {
+		fprintf(rec->f, "{\"version\": 2, \"width\": %u, \"height\": %u, "
+				"\"timestamp\": %llu}\n", REC_W, REC_H,
+				(unsigned long long)time(NULL));
+	}
+	disp_init();
+	ring_init(&rec->ring, 1 << 16);
+	rec->start = get_time_usec();
+	if (pthread_create(&rec->thread, NULL, rec_thread, rec))
+		ERR_EXIT("pthread_create failed\n");
+}
+
+// never blocks, unchanged frames are merged, drops frames if the queue is full
+static void rec_frame(recorder_t *rec, const uint8_t *mem) {
+	rec_frame_t fr;
+	disp_observe(mem, 0, 1, &fr.obs);
+	if (rec->queued && !memcmp(&fr.obs, &rec->last, sizeof(fr.obs))) return;
+	fr.time = get_time_usec() - rec->start;
+	if (ring_free(&rec->ring) < sizeof(fr)) {
+		rec->dropped++;
+		return;
+	}
+	ring_write(&rec->ring, &fr, sizeof(fr));
+	rec->last = fr.obs;
+	rec->queued = 1;
+	rec->frames++;
+}
+
+static void rec_close(recorder_t *rec) {
+	__atomic_store_n(&rec->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(rec->thread, NULL);
+	if (rec->gif) {
+		// the last frame stays for a second
+		if (rec->have_prev)
+			rec_gif_frame(rec, &rec->prev, rec->prev.time + 1000000);
+		fputc(0x3b, rec->f);
+	}
+	fclose(rec->f);
+	free(rec->ring.buf);
+	if (rec->dropped)
+		fprintf(stderr, "recorder: %u frames dropped\n", rec->dropped);
 }
 
 typedef struct {
@@ -538,275 +1386,1949 @@ static int check_state(cpu_state_t *s) {
 	return x >> 4;
 }
 
+enum { STATE_OK, STATE_ERR_SIZE, STATE_ERR_CORRUPT };
+
+static int state_load(cpu_state_t *s, const void *buf, size_t n) {
+	if (n != sizeof(*s)) return STATE_ERR_SIZE;
+	memcpy(s, buf, n);
+	return check_state(s) ? STATE_ERR_CORRUPT : STATE_OK;
+}
+
 #ifndef DECOMPILED
-static void run_game(uint8_t *rom, sysctx_t *sys, cpu_state_t *s) {
-	unsigned pc = s->pc;
-	unsigned a = s->a, cf = s->cf;
-	uint8_t pa = 0, pm = 0xf, ps = 0xf, pp = 0xf;
-	uint32_t tickcount = 0, prev_tick = 0, tmr_frac = 0;
-	uint64_t last_time;
+typedef struct {
+	cpu_state_t s;
+	uint32_t tickcount, tmr_frac, timer_inc;
+	uint8_t pa, pm, ps, pp;
+	uint8_t snd_num, snd_mode, snd_starts;
+	uint8_t ie, err;
+#if CPU_HASH
+	uint64_t mem_hash;
+#endif
+} cpuctx_t;
+
+enum { CPU_OK, CPU_ERR_OPCODE };
+
+#if CPU_HASH
+// Zobrist keys are computed rather than stored (splitmix64 of the index),
+// 0..0xfff are the memory nibbles, the rest are for the registers.
+static uint64_t zobrist(uint64_t i) {
+	uint64_t x = (i + 1) * 0x9e3779b97f4a7c15;
+	x = (x ^ x >> 30) * 0xbf58476d1ce4e5b9;
+	x = (x ^ x >> 27) * 0x94d049bb133111eb;
+	return x ^ x >> 31;
+}
 
-#define CPU_TRACE 0
+#define ZOBRIST_MEM(i, v) zobrist((i) << 4 | (v))
 
-	last_time = get_time_usec();
+static uint64_t cpu_mem_hash(const cpu_state_t *s) {
+	uint64_t h = 0;
+	unsigned i;
+	for (i = 0; i < 256; i++) h ^= ZOBRIST_MEM(i, s->mem[i]);
+	return h;
+}
 
-	for (;;) {
-		unsigned x, op;
-		op = rom[pc];
-#define R1R0 s->r[1] << 4 | s->r[0]
-#define R3R2 s->r[3] << 4 | s->r[2]
+// O(1): the memory part is updated by every write, the registers
+// are few enough to hash here, the inputs aren't a part of the state
+static uint64_t cpu_hash(const cpuctx_t *c) {
+	const cpu_state_t *s = &c->s;
+	uint64_t x = s->pc | s->stack << 12 | s->a << 25 | s->cf << 29 |
+			s->tf << 30 | (uint32_t)s->timer_en << 31 | (uint64_t)c->ie << 32;
+	uint64_t y = (uint64_t)s->tmr << 16 | c->tmr_frac;
+	unsigned i;
+	for (i = 0; i < 5; i++) y |= (uint64_t)s->r[i] << (24 + i * 4);
+	return c->mem_hash ^ zobrist(1ull << 60 | x) ^ zobrist(2ull << 60 | y);
+}
+#endif
 
-#if CPU_TRACE
-#define TRACE(...) fprintf(stderr, "  " __VA_ARGS__)
-		fprintf(stderr, "%03x: o=%02x,r=%x:%02x:%02x:%x,c%u",
-				pc, op, a, R1R0, R3R2, s->r[4], cf);
-#else
-#define TRACE(...) (void)0
-#endif
-
-	switch (op) {
-
-	case 0x00: /* RR A */
-		cf = a & 1; a = (a << 4 | a) >> 1 & 15; TRACE("a=%x,c=%u", a, cf); break;
-	case 0x01: /* RL A */
-		cf = a >> 3; a = (a << 4 | a) >> 3 & 15; TRACE("a=%x,c=%u", a, cf); break;
-	case 0x02: /* RRC A */
-		a = cf << 4 | a; cf = a & 1; a >>= 1; TRACE("a=%x,c=%u", a, cf); break;
-	case 0x03: /* RLC A */
-		a = a << 1 | cf; cf = a >> 4; a &= 15; TRACE("a=%x,c=%u", a, cf); break;
-
-	case 0x04: // MOV A, [R1R0]
-	case 0x06: // MOV A, [R3R2]
-		x = op & 2; x = s->r[x + 1] << 4 | s->r[x]; a = s->mem[x]; TRACE("a=%x", a); break;
-	case 0x05: // MOV [R1R0], A
-	case 0x07: // MOV [R3R2], A
-		x = op & 2; x = s->r[x + 1] << 4 | s->r[x]; s->mem[x] = a; TRACE("m[%02x]=%x", x, a); break;
-
-	case 0x08: /* ADC A, [R1R0] */
-	case 0x09: /* ADD A, [R1R0] */
-		cf &= ~op;
-		a += s->mem[R1R0] + cf; cf = a >> 4; a &= 15;
-		TRACE("a=%x", a);
-		break;
-
-	case 0x0a: /* SBC A, [R1R0] */
-	case 0x0b: /* SUB A, [R1R0] */
-		cf |= op & 1;
-		a += 15 - s->mem[R1R0] + cf; cf = a >> 4; a &= 15;
-		TRACE("a=%x", a);
-		break;
-
-	case 0x0c: // INC [R1R0]
-	case 0x0d: // DEC [R1R0]
-	case 0x0e: // INC [R3R2]
-	case 0x0f: // DEC [R3R2]
-		x = op & 2; x = s->r[x + 1] << 4 | s->r[x];
-		s->mem[x] = (s->mem[x] + (op & 1 ? -1 : 1)) & 15;
-		TRACE("m[%02x]=%x", x, s->mem[x]);
-		break;
-
-	case 0x10: case 0x12: // INC Rn
-	case 0x14: case 0x16: case 0x18:
-		x = op >> 1 & 7; s->r[x] = (s->r[x] + 1) & 15; TRACE("r%u=%x", x, s->r[x]); break;
-
-	case 0x11: case 0x13: // DEC Rn
-	case 0x15: case 0x17: case 0x19:
-		x = op >> 1 & 7; s->r[x] = (s->r[x] - 1) & 15; TRACE("r%u=%x", x, s->r[x]); break;
-
-	case 0x1a: /* AND A, [R1R0] */ a &= s->mem[R1R0]; TRACE("a=%x", a); break;
-	case 0x1b: /* XOR A, [R1R0] */ a ^= s->mem[R1R0]; TRACE("a=%x", a); break;
-	case 0x1c: /* OR A, [R1R0] */ a |= s->mem[R1R0]; TRACE("a=%x", a); break;
-	case 0x1d: /* AND [R1R0], A */ s->mem[R1R0] &= a; TRACE("m[%02x]=%x", R1R0, s->mem[R1R0]); break;
-	case 0x1e: /* XOR [R1R0], A */ s->mem[R1R0] ^= a; TRACE("m[%02x]=%x", R1R0, s->mem[R1R0]); break;
-	case 0x1f: /* OR [R1R0], A */ s->mem[R1R0] |= a; TRACE("m[%02x]=%x", R1R0, s->mem[R1R0]); break;
-
-	case 0x20: case 0x22: // MOV Rn, A
-	case 0x24: case 0x26: case 0x28:
-		s->r[op >> 1 & 7] = a; TRACE("r%u=%x", op >> 1 & 7, a); break;
-
-	case 0x21: case 0x23: // MOV A, Rn
-	case 0x25: case 0x27: case 0x29:
-		a = s->r[op >> 1 & 7]; TRACE("a=%x", a); break;
-
-	case 0x2a: /* CLC */ cf = 0; TRACE("c=%x", cf); break;
-	case 0x2b: /* STC */ cf = 1; TRACE("c=%x", cf); break;
-	case 0x2c: /* EI */ /* TODO */; TRACE("i=%x", 1); break;
-	case 0x2d: /* DI */ /* TODO */; TRACE("i=%x", 0); break;
-	case 0x2e: /* RET */
-		pc = s->stack; TRACE("pc=%03x", pc); pc--; break;
-	case 0x2f: /* RETI */
-		pc = s->stack; cf = pc >> 12; TRACE("pc=%03x,c=%u", pc, cf); pc--; break;
-
-	case 0x30: /* OUT PA, A */ pa = a; TRACE("pa=%x", pa); break;
-	case 0x31: /* INC A */ a = (a + 1) & 15; TRACE("a=%x", a); break;
-	case 0x32: /* IN A, PM */ a = pm; TRACE("a=%x", a); break;
-	case 0x33: /* IN A, PS */ a = ps; TRACE("a=%x", a); break;
-	case 0x34: /* IN A, PP */ a = pp; TRACE("a=%x", a); break;
-	case 0x35: /* unknown */ break;
-	case 0x36: /* DAA */
-		if (a >= 10 || cf) a = (a + 6) & 15, cf = 1, TRACE("a=%x,c=%u", a, cf);
-		break;
-	case 0x37: /* HALT */
-		TRACE("halt"); break;
-	case 0x38: /* TIMER ON */
-		s->timer_en = 1; TRACE("timer on"); break;
-	case 0x39: /* TIMER OFF */
-		s->timer_en = 0; TRACE("timer off"); break;
-	case 0x3a: /* MOV A, TMRL */
-		a = s->tmr & 15; TRACE("a=%x", a); break;
-	case 0x3b: /* MOV A, TMRH */
-		a = s->tmr >> 4; TRACE("a=%x", a); break;
-	case 0x3c: /* MOV TMRL, A */
-		s->tmr = (s->tmr & 0xf0) | a; TRACE("tmrl=%x", a); break;
-	case 0x3d: /* MOV TMRH, A */
-		s->tmr = a << 4 | (s->tmr & 15); TRACE("tmrh=%x", a); break;
-	case 0x3e: /* NOP */
-		TRACE("nop"); break;
-	case 0x3f: /* DEC A */ a = (a - 1) & 15; TRACE("a=%x", a); break;
-
-	case 0x40: // ADD A, imm4
-		a += rom[++pc & 0xfff] & 15;
-		cf = a >> 4; a &= 15; TRACE("a=%x", a); break;
-	case 0x41: // SUB A, imm4
-		a += 16 - (rom[++pc & 0xfff] & 15);
-		cf = a >> 4; a &= 15; TRACE("a=%x", a); break;
-	case 0x42: // AND A, imm4
-		a &= rom[++pc & 0xfff]; TRACE("a=%x", a); break;
-	case 0x43: // XOR A, imm4
-		a ^= rom[++pc & 0xfff] & 15; TRACE("a=%x", a); break;
-	case 0x44: // OR A, imm4
-		a |= rom[++pc & 0xfff] & 15; TRACE("a=%x", a); break;
-	case 0x45: // SOUND imm4
-		x = rom[++pc & 0xfff] & 15; TRACE("sound %x", x);
-		(void)x; /* TODO */ break;
-	case 0x46: // MOV R4, imm4
-		s->r[4] = rom[++pc & 0xfff] & 15; TRACE("r4=%x", s->r[4]); break;
-	case 0x47: // TIMER imm8
-		s->tmr = rom[++pc & 0xfff]; TRACE("tmr=%02x", s->tmr); break;
-	case 0x48: /* SOUND ONE */ TRACE("sound one"); /* TODO */ break;
-	case 0x49: /* SOUND LOOP */ TRACE("sound loop"); /* TODO */ break;
-	case 0x4a: /* SOUND OFF */ TRACE("sound off"); /* TODO */ break;
-	case 0x4b: /* SOUND A */ TRACE("sound a"); /* TODO */ break;
-	case 0x4c: /* READ R4A */
-		a = rom[(pc & 0xf00) | a << 4 | s->mem[R1R0]];
-		TRACE("r4:a=%02x", a);
-		s->r[4] = a >> 4; a &= 15; break;
-	case 0x4d: /* READF R4A */
-		a = rom[0xf00 | a << 4 | s->mem[R1R0]];
-		TRACE("r4:a=%02x", a);
-		s->r[4] = a >> 4; a &= 15; break;
-	case 0x4e: /* READ MR0A */
-		a = rom[(pc & 0xf00) | a << 4 | s->r[4]];
-		TRACE("m[%02x]:a=%02x", R1R0, a);
-		s->mem[R1R0] = a >> 4; a &= 15; break;
-	case 0x4f: /* READF MR0A */
-		a = rom[0xf00 | a << 4 | s->r[4]];
-		TRACE("m[%02x]:a=%02x", R1R0, a);
-		s->mem[R1R0] = a >> 4; a &= 15; break;
-
-#define CASE8(x) \
-	case x:     case x + 1: case x + 2: case x + 3: \
-	case x + 4: case x + 5: case x + 6: case x + 7:
-
-	CASE8(0x50) CASE8(0x58) // MOV R1R0, imm8
-		s->r[0] = op & 0xf; s->r[1] = rom[++pc & 0xfff] & 15; TRACE("r1r0=%02x", R1R0); break;
-	CASE8(0x60) CASE8(0x68) // MOV R3R2, imm8
-		s->r[2] = op & 0xf; s->r[3] = rom[++pc & 0xfff] & 15; TRACE("r3r2=%02x", R3R2); break;
-
-	CASE8(0x70) CASE8(0x78) /* MOV A, imm4 */ a = op & 15; TRACE("a=%x", a); break;
-
-#define JMP11 \
-	x = (pc & 0x800) | (op & 7) << 8 | rom[(pc + 1) & 0xfff]; pc++;
-#define TRACE_JUMP TRACE("pc=%03x", pc + 1); else TRACE("no jump")
-#define X(cond) JMP11 if (cond) pc = x - 1, TRACE_JUMP; break;
-	CASE8(0x80) CASE8(0x88) // JAn imm11
-	CASE8(0x90) CASE8(0x98) X(a >> (op >> 3 & 3) & 1)
-	CASE8(0xa0) /* JNZ R0, imm11 */ X(s->r[0])
-	CASE8(0xa8) /* JNZ R1, imm11 */ X(s->r[1])
-	CASE8(0xb0) /* JZ A, imm11 */ X(!a)
-	CASE8(0xb8) /* JNZ A, imm11 */ X(a)
-	CASE8(0xc0) /* JC imm11 */ X(cf)
-	CASE8(0xc8) /* JNC imm11 */ X(!cf)
-	CASE8(0xd0) /* JTMR imm11 */ JMP11 if (s->tf) pc = x - 1, TRACE_JUMP; s->tf = 0; break;
-	CASE8(0xd8) /* JNZ R4, imm11 */ X(s->r[4])
-#undef X
-#undef JMP11
-
-	CASE8(0xe0) CASE8(0xe8) // JMP imm12
-		pc = (op & 15) << 8 | rom[(pc + 1) & 0xfff];
-		TRACE("pc=%03x", pc);
-		pc--; break;
-	CASE8(0xf0) CASE8(0xf8) // CALL imm12
-		s->stack = (pc + 2) & 0xfff;
-		pc = (op & 15) << 8 | rom[(pc + 1) & 0xfff];
-		TRACE("pc=%03x,ret=%03x", pc, s->stack);
-		pc--; break;
-
-	default:
-		ERR_EXIT("unknown opcode\n");
-	} // end switch
+static void cpu_init(cpuctx_t *c, cpu_state_t *s, unsigned timer_inc) {
+	memset(c, 0, sizeof(*c));
+	c->s = *s;
+	c->timer_inc = timer_inc;
+	c->pm = c->ps = c->pp = 0xf;
+#if CPU_HASH
+	c->mem_hash = cpu_mem_hash(s);
+#endif
+}
 
-#if CPU_TRACE
-		fprintf(stderr, "\n");
+// timer interrupt after EI, the known ROM doesn't use it,
+// ie isn't stored in save states
+#ifndef INT_TIMER
+#define INT_TIMER 0
 #endif
-		pc = (pc + 1) & 0xfff;
-		tickcount++;
 
-#if CPU_TRACE
-		if (tickcount > 2150) {
-			// display_redraw(sys, s->mem);
-			break;
-		}
+#ifndef INT_VECTOR
+#define INT_VECTOR 0x004
 #endif
 
-		// 1ms
-		if (tickcount - prev_tick >= sys->sleep_ticks) {
-			uint64_t new_time, delay;
-			uint32_t keys, sleep_delay;
-			prev_tick = tickcount;
-			sys_redraw(sys, s->mem);
-			new_time = get_time_usec();
-			delay = new_time - last_time;
-			sleep_delay = sys->sleep_delay;
-			if (delay > sleep_delay) {
-				last_time = new_time;
-			} else {
-				last_time += sleep_delay;
-				usleep(sleep_delay - delay);
-			}
-			keys = ~sys_events(sys);
-			if (!(keys & 0x10000)) break;
-			pp = keys & 15;
-			ps = keys >> 4 & 15;
-		}
+// ticks until the timer overflows
+static uint32_t cpu_timer_left(const cpuctx_t *c) {
+	uint32_t t = (1 << 24) - (c->s.tmr << 16 | c->tmr_frac);
+	uint32_t inc = c->timer_inc;
+	if (!inc) return ~0u;
+	return (t + inc - 1) / inc;
+}
 
-		if (s->timer_en) {
-			tmr_frac += sys->timer_inc;
-			if (tmr_frac >= 0x10000) {
-				tmr_frac -= 0x10000;
-				if (!++s->tmr) s->tf = 1;
-			}
-		}
+static void cpu_interrupt(cpuctx_t *c) {
+	cpu_state_t *s = &c->s;
+	s->stack = s->cf << 12 | s->pc;
+	s->pc = INT_VECTOR;
+	s->tf = 0; c->ie = 0;
+}
 
-		(void)pa;
+#define CPU_TRACE 0
 
-	} // end for
+// collects opcode pair/triple frequencies to choose fused handlers
+#ifndef OP_STATS
+#define OP_STATS 0
+#endif
 
-	s->pc = pc; s->a = a; s->cf = cf;
-}
-#else
-void run_decomp(sysctx_t *user, cpu_state_t *cpu);
+// executes frequent opcode pairs in a single dispatch
+#ifndef CPU_FUSE
+#define CPU_FUSE (!CPU_TRACE && !OP_STATS)
 #endif
 
-static void test_keys() {
-	char x;
-	while ((x | 32) != 'q')
-		if (read(0, &x, 1) == 1)
-			printf("0x%02x %u\n", x, x);
+#if OP_STATS
+// immediates and jump addresses are masked out of the opcode
+#define OP_CLASS(op) ((op) & ((op) >= 0xe0 || (unsigned)((op) - 0x50) < 0x30 ? 0xf0 : \
+	(op) >= 0x80 ? 0xf8 : 0xff))
+#define OP_TRIPLES (1 << 16)
+static uint32_t op_pairs[256 * 256];
+static uint32_t op_triples[OP_TRIPLES][2];
+
+static void op_stats_add(unsigned ops) {
+	unsigned i, h = ops * 0x9e3779b1 >> 16;
+	op_pairs[ops & 0xffff]++;
+	ops |= 1 << 24; // never zero
+	for (i = 0; i < OP_TRIPLES; i++, h = (h + 1) & (OP_TRIPLES - 1)) {
+		if (!op_triples[h][0]) op_triples[h][0] = ops;
+		if (op_triples[h][0] == ops) { op_triples[h][1]++; break; }
+	}
 }
 
-#if USE_GAMEPAD
-static void test_gamepad(int js_fd) {
+static int op_stats_cmp(const void *a, const void *b) {
+	uint32_t x = ((const uint32_t*)a)[1], y = ((const uint32_t*)b)[1];
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void op_stats_dump(const char *fn) {
+	static uint32_t list[256 * 256][2];
+	unsigned i, n = 0;
+	FILE *f = fopen(fn, "w");
+	if (!f) ERR_EXIT("fopen failed\n");
+	for (i = 0; i < 256 * 256; i++)
+		if (op_pairs[i]) list[n][0] = i, list[n++][1] = op_pairs[i];
+	qsort(list, n, sizeof(list[0]), op_stats_cmp);
+	fprintf(f, "# pairs\n");
+	for (i = 0; i < n && i < 64; i++)
+		fprintf(f, "%10u  %02x %02x\n", list[i][1], list[i][0] >> 8, list[i][0] & 0xff);
+	qsort(op_triples, OP_TRIPLES, sizeof(op_triples[0]), op_stats_cmp);
+	fprintf(f, "# triples\n");
+	for (i = 0; i < OP_TRIPLES && i < 64 && op_triples[i][1]; i++) {
+		unsigned x = op_triples[i][0];
+		fprintf(f, "%10u  %02x %02x %02x\n", op_triples[i][1],
+				x >> 16 & 0xff, x >> 8 & 0xff, x & 0xff);
+	}
+	fclose(f);
+}
+#endif
+
+// one byte for each ROM address, merged with OR
+enum { COV_EXEC = 1, COV_TAKEN = 2, COV_NOT_TAKEN = 4 };
+static uint8_t cov_map[0x1000];
+static int cov_on;
+
+static void cov_load(const char *fn) {
+	FILE *f = fopen(fn, "rb");
+	cov_on = 1;
+	if (!f) return;
+	if (fread(cov_map, 1, sizeof(cov_map), f) != sizeof(cov_map))
+		ERR_EXIT("unexpected coverage map size\n");
+	fclose(f);
+}
+
+static void cov_save(const char *fn) {
+	FILE *f = fopen(fn, "wb");
+	if (!f) ERR_EXIT("fopen failed\n");
+	fwrite(cov_map, 1, sizeof(cov_map), f);
+	fclose(f);
+}
+
+#if MEM_STATS
+static void mem_stats_dump(const char *fn) {
+	FILE *f = fopen(fn, "w");
+	unsigned i;
+	if (!f) ERR_EXIT("fopen failed\n");
+	fprintf(f, "addr,reads,writes\n");
+	for (i = 0; i < 256; i++)
+		fprintf(f, "%u,%llu,%llu\n", i, (unsigned long long)mem_reads[i],
+				(unsigned long long)mem_writes[i]);
+	fclose(f);
+}
+#endif
+
+#if USE_DEBUG
+enum { DBG_READ = 1, DBG_WRITE = 2, DBG_CHANGE = 4, DBG_VALUE = 8 };
+enum { DBG_HIT_BREAK = 1, DBG_HIT_WATCH, DBG_HIT_USER };
+
+// break only if "what" is equal to val,
+// what: 1 = A, 2 = CF, 0x10 + n = Rn, 0x100 + addr = [addr]
+typedef struct { uint16_t what; uint8_t val; } dbg_cond_t;
+
+typedef struct {
+	unsigned count; // the instrumented loop is used if not zero
+	uint8_t resume, hit;
+	uint16_t hit_addr;
+	int hit_old, hit_new;
+	uint8_t bp[0x1000], watch[256], watch_val[256];
+	dbg_cond_t cond[0x1000];
+} dbg_t;
+
+static dbg_t dbg;
+
+// val < 0 for reads
+static unsigned dbg_access(unsigned addr, int val, unsigned old) {
+	unsigned w = dbg.watch[addr];
+	if (dbg.hit) return old;
+	if (val < 0 ? w & DBG_READ : w & DBG_WRITE ||
+			(w & DBG_CHANGE && (unsigned)val != old) ||
+			(w & DBG_VALUE && (unsigned)val == dbg.watch_val[addr])) {
+		dbg.hit = DBG_HIT_WATCH; dbg.hit_addr = addr;
+		dbg.hit_old = old; dbg.hit_new = val;
+	}
+	return old;
+}
+
+static unsigned dbg_what(const cpu_state_t *s, unsigned what,
+		unsigned a, unsigned cf) {
+	if (what >= 0x100) return s->mem[what & 0xff];
+	if (what >= 0x10) return s->r[what & 7];
+	return what == 1 ? a : cf;
+}
+
+static int dbg_break(const cpu_state_t *s, unsigned pc, unsigned a, unsigned cf) {
+	const dbg_cond_t *cond = &dbg.cond[pc];
+	if (cond->what && dbg_what(s, cond->what, a, cf) != cond->val) return 0;
+	dbg.hit = DBG_HIT_BREAK; dbg.hit_addr = pc;
+	return 1;
+}
+#endif
+
+#define CPU_RUN cpu_run
+#define CPU_DEBUG 0
+#define CPU_COV 0
+#include "ht4bit_cpu.h"
+#undef CPU_RUN
+#undef CPU_DEBUG
+#undef CPU_COV
+
+#define CPU_RUN cpu_run_cov
+#define CPU_DEBUG 0
+#define CPU_COV 1
+#include "ht4bit_cpu.h"
+#undef CPU_RUN
+#undef CPU_DEBUG
+#undef CPU_COV
+
+#if MEM_STATS
+#define CPU_RUN cpu_run_mem
+#define CPU_DEBUG 0
+#define CPU_COV 0
+#define CPU_MEM 1
+#include "ht4bit_cpu.h"
+#undef CPU_RUN
+#undef CPU_DEBUG
+#undef CPU_COV
+#undef CPU_MEM
+#endif
+
+#if USE_DEBUG
+#define CPU_RUN cpu_run_debug
+#define CPU_DEBUG 1
+#define CPU_COV 1
+#include "ht4bit_cpu.h"
+#undef CPU_RUN
+#undef CPU_DEBUG
+#undef CPU_COV
+
+// "1a3", "1a3 a=5", "1a3 c=1", "1a3 r4=0", "1a3 [8f]=3"
+static int dbg_set_break(const char *str) {
+	char *end; unsigned pc, what = 0, val = 0;
+	pc = strtoul(str, &end, 16);
+	if (end == str || pc > 0xfff) return -1;
+	for (str = end; *str == ' '; str++);
+	if (*str) {
+		if (*str == 'a') what = 1, str++;
+		else if (*str == 'c') what = 2, str++;
+		else if (*str == 'r' && str[1] >= '0' && str[1] <= '4')
+			what = 0x10 + str[1] - '0', str += 2;
+		else if (*str == '[') {
+			what = strtoul(str + 1, &end, 16);
+			if (end == str + 1 || *end != ']' || what > 0xff) return -1;
+			what += 0x100; str = end + 1;
+		} else return -1;
+		if (*str++ != '=') return -1;
+		val = strtoul(str, &end, 16);
+		if (end == str || *end || val > 15) return -1;
+	}
+	if (!dbg.bp[pc]) dbg.count++;
+	dbg.bp[pc] = 1;
+	dbg.cond[pc].what = what; dbg.cond[pc].val = val;
+	return 0;
+}
+
+// "8f" (same as "8f w"), "8f rw", "8f c", "8f =3"
+static int dbg_set_watch(const char *str) {
+	char *end; unsigned addr, flags = 0, val = 0;
+	addr = strtoul(str, &end, 16);
+	if (end == str || addr > 0xff) return -1;
+	for (str = end; *str; str++) {
+		if (*str == ' ') continue;
+		else if (*str == 'r') flags |= DBG_READ;
+		else if (*str == 'w') flags |= DBG_WRITE;
+		else if (*str == 'c') flags |= DBG_CHANGE;
+		else if (*str == '=') {
+			val = strtoul(str + 1, &end, 16);
+			if (end == str + 1 || val > 15) return -1;
+			flags |= DBG_VALUE; str = end - 1;
+		} else return -1;
+	}
+	if (!flags) flags = DBG_WRITE;
+	if (!dbg.watch[addr]) dbg.count++;
+	dbg.watch[addr] = flags; dbg.watch_val[addr] = val;
+	return 0;
+}
+
+static void dbg_list(void) {
+	static const char * const what[3] = { "", "a", "c" };
+	unsigned i;
+	for (i = 0; i < 0x1000; i++) {
+		unsigned w = dbg.cond[i].what;
+		if (!dbg.bp[i]) continue;
+		printf("b %03x", i);
+		if (w >= 0x100) printf(" [%02x]", w & 0xff);
+		else if (w >= 0x10) printf(" r%u", w & 7);
+		else if (w) printf(" %s", what[w]);
+		if (w) printf("=%x", dbg.cond[i].val);
+		printf("\n");
+	}
+	for (i = 0; i < 256; i++) {
+		unsigned w = dbg.watch[i];
+		if (!w) continue;
+		printf("w %02x %s%s%s", i, w & DBG_READ ? "r" : "",
+				w & DBG_WRITE ? "w" : "", w & DBG_CHANGE ? "c" : "");
+		if (w & DBG_VALUE) printf("=%x", dbg.watch_val[i]);
+		printf("\n");
+	}
+}
+
+static void dbg_state(const uint8_t *rom, const cpuctx_t *c) {
+	const cpu_state_t *s = &c->s;
+	printf("%03x: o=%02x,r=%x:%x%x:%x%x:%x,c%u,tmr=%02x,tf=%u,t%u,ret=%03x\n",
+			s->pc, rom[s->pc], s->a, s->r[1], s->r[0], s->r[3], s->r[2],
+			s->r[4], s->cf, s->tmr, s->tf, s->timer_en, s->stack);
+}
+
+static void dbg_report(const uint8_t *rom, const cpuctx_t *c) {
+	if (dbg.hit == DBG_HIT_BREAK)
+		printf("breakpoint %03x\n", dbg.hit_addr);
+	else if (dbg.hit == DBG_HIT_WATCH) {
+		if (dbg.hit_new < 0)
+			printf("read [%02x] = %x\n", dbg.hit_addr, dbg.hit_old);
+		else
+			printf("write [%02x] = %x -> %x\n", dbg.hit_addr, dbg.hit_old, dbg.hit_new);
+	} else printf("stopped\n");
+	dbg.hit = 0;
+	dbg_state(rom, c);
+}
+
+// returns 1 to exit the emulator
+static int dbg_prompt(const uint8_t *rom, sysctx_t *sys, cpuctx_t *c) {
+	char line[256];
+	int ret = 0;
+
+	// the prompt reads stdin itself
+	sys_input_stop(sys);
+	tcsetattr(0, TCSANOW, &sys->tcattr);
+	printf("\33[26H\33[J\33[?25h");
+	dbg_report(rom, c);
+	for (;;) {
+		char *p, *cmd;
+		printf("> ");
+		fflush(stdout);
+		if (!fgets(line, sizeof(line), stdin)) { ret = 1; break; }
+		p = line + strlen(line);
+		while (p > line && (p[-1] == '\n' || p[-1] == ' ')) *--p = 0;
+		for (cmd = line; *cmd == ' '; cmd++);
+		for (p = cmd; *p && *p != ' '; p++);
+		if (*p) *p++ = 0;
+		while (*p == ' ') p++;
+
+		if (!*cmd) continue;
+		if (!strcmp(cmd, "c")) { dbg.resume = 1; break; }
+		if (!strcmp(cmd, "q")) { ret = 1; break; }
+		if (!strcmp(cmd, "s")) {
+			unsigned n = *p ? strtoul(p, NULL, 0) : 1;
+			while (n--) {
+				dbg.resume = 1;
+				cpu_run_debug(rom, c, 1);
+				if (dbg.hit) { dbg_report(rom, c); break; }
+				dbg_state(rom, c);
+			}
+		} else if (!strcmp(cmd, "b") || !strcmp(cmd, "w")) {
+			if (!*p) dbg_list();
+			else if ((*cmd == 'b' ? dbg_set_break : dbg_set_watch)(p))
+				printf("bad %s\n", *cmd == 'b' ? "breakpoint" : "watchpoint");
+		} else if (!strcmp(cmd, "db") || !strcmp(cmd, "dw")) {
+			unsigned i = 0, n = cmd[1] == 'b' ? 0x1000 : 256;
+			uint8_t *list = cmd[1] == 'b' ? dbg.bp : dbg.watch;
+			if (*p) i = strtoul(p, NULL, 16), n = i < n ? i + 1 : 0;
+			for (; i < n; i++)
+				if (list[i]) list[i] = 0, dbg.count--;
+		} else if (!strcmp(cmd, "r")) {
+			dbg_state(rom, c);
+		} else if (!strcmp(cmd, "m")) {
+			unsigned i, j;
+			for (i = 0; i < 16; i++) {
+				printf("%x:", i);
+				for (j = 0; j < 16; j++) printf(" %x", c->s.mem[i << 4 | j]);
+				printf("\n");
+			}
+		} else if (!strcmp(cmd, "h")) {
+			printf(
+"c          continue\n"
+"s [n]      step N instructions\n"
+"b [spec]   set a breakpoint or list all: 1a3, 1a3 a=5, 1a3 r4=0, 1a3 [8f]=3\n"
+"w [spec]   set a watchpoint or list all: 8f (write), 8f r, 8f c (change), 8f =3\n"
+"db [addr]  delete a breakpoint or all of them\n"
+"dw [addr]  delete a watchpoint or all of them\n"
+"r          show registers\n"
+"m          show memory\n"
+"q          exit the emulator\n");
+		} else printf("unknown command, h for help\n");
+	}
+	sys_raw(sys);
+	sys_repaint(sys);
+	sys_input_start(sys);
+	return ret;
+}
+#endif
+
+// selects the interpreter variant
+static uint32_t cpu_exec(const uint8_t *rom, cpuctx_t *c, uint32_t ticks) {
+	uint32_t left;
+#if USE_DEBUG
+	if (dbg.count) left = cpu_run_debug(rom, c, ticks); else
+#endif
+#if MEM_STATS
+	if (mem_on) left = cpu_run_mem(rom, c, ticks); else
+#endif
+	if (cov_on) left = cpu_run_cov(rom, c, ticks);
+	else left = cpu_run(rom, c, ticks);
+	if (c->err) ERR_EXIT("unknown opcode at 0x%03x\n", c->s.pc);
+	return left;
+}
+
+// screen updates in fast-forward
+#define FF_REDRAW_USEC 20000
+
+static uint64_t rom_hash(const uint8_t *rom) {
+	uint64_t h = 0xcbf29ce484222325; // FNV-1a
+	unsigned i;
+	for (i = 0; i < 0x1000; i++) h = (h ^ rom[i]) * 0x100000001b3;
+	return h;
+}
+
+// Replay file: the header, records of the key changes with a keyframe
+// (the whole state) every REPLAY_INTERVAL ticks, then the index of the
+// keyframes. Records are fixed-size structures in the native byte order,
+// aligned to 8 bytes, so the file can be mapped and used as is.
+#define REPLAY_MAGIC 0x31504742 // "BGP1"
+#define REPLAY_INTERVAL (1 << 23) // about 8 seconds of emulated time
+
+typedef struct {
+	uint32_t magic, version;
+	uint64_t rom_hash;
+	uint32_t timer_inc, frame_ticks, frame_usec, interval;
+	uint64_t end_tick;
+	uint64_t index_off; // 0 if the recording wasn't finished
+	uint32_t nkeys, reserved;
+} replay_hdr_t;
+
+enum { REPLAY_INPUT = 1, REPLAY_KEYFRAME };
+
+typedef struct {
+	uint64_t tick; // from the start of the recording
+	uint32_t type;
+	uint32_t keys; // sys_keys() bits from this tick on
+} replay_rec_t;
+
+typedef struct {
+	replay_rec_t r;
+	cpu_state_t s;
+	uint8_t ie, reserved;
+	uint32_t tmr_frac, reserved2;
+} replay_key_t;
+
+typedef struct { uint64_t tick, off; } replay_index_t;
+
+typedef struct replay {
+	replay_hdr_t hdr;
+	uint64_t tick; // current
+	uint64_t next_key; // recording
+	uint32_t count, keys; // recording, c.tickcount at tick
+	FILE *f;
+	replay_index_t *index; // while recording
+	unsigned nindex, index_max;
+	const uint8_t *map; // playback
+	size_t size, pos, end;
+	cpuctx_t c; // the state after seeking
+	unsigned diverged;
+	uint64_t diverged_tick;
+} replay_t;
+
+static unsigned replay_keys(const cpuctx_t *c) {
+	return (~c->pp & 15) | (~c->ps & 15) << 4;
+}
+
+static void replay_set_keys(cpuctx_t *c, unsigned keys) {
+	c->pp = ~keys & 15;
+	c->ps = ~keys >> 4 & 15;
+}
+
+static void replay_write_key(replay_t *rp, const cpuctx_t *c) {
+	replay_key_t k;
+	memset(&k, 0, sizeof(k));
+	k.r.tick = rp->tick;
+	k.r.type = REPLAY_KEYFRAME;
+	k.r.keys = rp->keys;
+	k.s = c->s;
+	k.ie = c->ie;
+	k.tmr_frac = c->tmr_frac;
+	if (rp->nindex == rp->index_max) {
+		rp->index_max = rp->index_max ? rp->index_max * 2 : 64;
+		rp->index = realloc(rp->index, rp->index_max * sizeof(*rp->index));
+		if (!rp->index) ERR_EXIT("realloc failed\n");
+	}
+	rp->index[rp->nindex].tick = rp->tick;
+	rp->index[rp->nindex++].off = ftell(rp->f);
+	if (fwrite(&k, sizeof(k), 1, rp->f) != 1) ERR_EXIT("fwrite failed\n");
+	rp->next_key = rp->tick + rp->hdr.interval;
+}
+
+static void replay_create(replay_t *rp, const char *fn, const uint8_t *rom,
+		const cpuctx_t *c, unsigned frame_ticks, unsigned frame_usec) {
+	memset(rp, 0, sizeof(*rp));
+	rp->f = fopen(fn, "wb");
+	if (!rp->f) ERR_EXIT("fopen failed\n");
+	rp->hdr.magic = REPLAY_MAGIC;
+	rp->hdr.version = 1;
+	rp->hdr.rom_hash = rom_hash(rom);
+	rp->hdr.timer_inc = c->timer_inc;
+	rp->hdr.frame_ticks = frame_ticks;
+	rp->hdr.frame_usec = frame_usec;
+	rp->hdr.interval = REPLAY_INTERVAL;
+	// rewritten with the index at the end
+	if (fwrite(&rp->hdr, sizeof(rp->hdr), 1, rp->f) != 1) ERR_EXIT("fwrite failed\n");
+	rp->count = c->tickcount;
+	rp->keys = replay_keys(c);
+	replay_write_key(rp, c);
+}
+
+// called after the keys for the next time slice are set
+static void replay_slice(replay_t *rp, const cpuctx_t *c) {
+	unsigned keys = replay_keys(c);
+	rp->tick += (uint32_t)(c->tickcount - rp->count);
+	rp->count = c->tickcount;
+	if (rp->tick >= rp->next_key) {
+		rp->keys = keys;
+		replay_write_key(rp, c);
+	} else if (keys != rp->keys) {
+		replay_rec_t r;
+		r.tick = rp->tick;
+		r.type = REPLAY_INPUT;
+		r.keys = rp->keys = keys;
+		if (fwrite(&r, sizeof(r), 1, rp->f) != 1) ERR_EXIT("fwrite failed\n");
+	}
+}
+
+static void replay_finish(replay_t *rp, const cpuctx_t *c) {
+	rp->tick += (uint32_t)(c->tickcount - rp->count);
+	rp->hdr.end_tick = rp->tick;
+	rp->hdr.index_off = ftell(rp->f);
+	rp->hdr.nkeys = rp->nindex;
+	if (fwrite(rp->index, sizeof(*rp->index), rp->nindex, rp->f) != rp->nindex ||
+			fseek(rp->f, 0, SEEK_SET) ||
+			fwrite(&rp->hdr, sizeof(rp->hdr), 1, rp->f) != 1)
+		ERR_EXIT("fwrite failed\n");
+	fclose(rp->f);
+	free(rp->index);
+}
+
+static void replay_open(replay_t *rp, const char *fn, const uint8_t *rom) {
+	struct stat st;
+	int fd = open(fn, O_RDONLY);
+	memset(rp, 0, sizeof(*rp));
+	if (fd < 0) ERR_EXIT("open failed\n");
+	if (fstat(fd, &st)) ERR_EXIT("fstat failed\n");
+	rp->size = st.st_size;
+	if (rp->size < sizeof(replay_hdr_t) + sizeof(replay_key_t))
+		ERR_EXIT("replay is too short\n");
+	rp->map = mmap(NULL, rp->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (rp->map == MAP_FAILED) ERR_EXIT("mmap failed\n");
+	close(fd);
+	memcpy(&rp->hdr, rp->map, sizeof(rp->hdr));
+	if (rp->hdr.magic != REPLAY_MAGIC || rp->hdr.version != 1)
+		ERR_EXIT("not a replay file\n");
+	if (rp->hdr.rom_hash != rom_hash(rom)) ERR_EXIT("replay is for another ROM\n");
+	rp->end = rp->size;
+	if (rp->hdr.index_off) {
+		// the records are aligned, the first keyframe is before the index
+		if (rp->hdr.index_off % 8 ||
+				rp->hdr.index_off < sizeof(rp->hdr) + sizeof(replay_key_t) ||
+				rp->hdr.index_off > rp->size || (rp->size - rp->hdr.index_off) /
+				sizeof(replay_index_t) < rp->hdr.nkeys) ERR_EXIT("bad replay index\n");
+		rp->end = rp->hdr.index_off;
+	}
+}
+
+// the record at pos, NULL at the end
+static const replay_rec_t *replay_rec(const replay_t *rp, size_t pos) {
+	const replay_rec_t *r = (const replay_rec_t*)(rp->map + pos);
+	size_t n = sizeof(*r);
+	if (rp->end - pos < n) return NULL;
+	if (r->type == REPLAY_KEYFRAME) n = sizeof(replay_key_t);
+	else if (r->type != REPLAY_INPUT) ERR_EXIT("bad replay record\n");
+	return rp->end - pos < n ? NULL : r;
+}
+
+static size_t replay_rec_size(const replay_rec_t *r) {
+	return r->type == REPLAY_KEYFRAME ? sizeof(replay_key_t) : sizeof(*r);
+}
+
+// runs n ticks with the recorded keys, the keyframes on the way
+// are compared with the state
+static void replay_run(const uint8_t *rom, replay_t *rp, cpuctx_t *c, uint32_t n) {
+	uint64_t end = rp->tick + n;
+	const replay_rec_t *r;
+	while ((r = replay_rec(rp, rp->pos)) && r->tick <= end) {
+		if (r->tick > rp->tick) cpu_exec(rom, c, r->tick - rp->tick);
+		rp->tick = r->tick;
+		replay_set_keys(c, r->keys);
+		if (r->type == REPLAY_KEYFRAME) {
+			const replay_key_t *k = (const replay_key_t*)r;
+			if (memcmp(&c->s, &k->s, sizeof(k->s)) ||
+					c->tmr_frac != k->tmr_frac || c->ie != k->ie)
+				if (!rp->diverged++) rp->diverged_tick = r->tick;
+		}
+		rp->pos += replay_rec_size(r);
+	}
+	if (end > rp->tick) cpu_exec(rom, c, end - rp->tick);
+	rp->tick = end;
+}
+
+// loads the last keyframe before the tick and runs up to it
+static void replay_seek(const uint8_t *rom, replay_t *rp, uint64_t tick) {
+	const replay_key_t *k = NULL;
+	size_t pos = sizeof(replay_hdr_t);
+	uint64_t time = get_time_usec();
+	if (rp->hdr.end_tick && tick > rp->hdr.end_tick) tick = rp->hdr.end_tick;
+	if (rp->hdr.index_off) {
+		const replay_index_t *index = (const replay_index_t*)(rp->map + rp->hdr.index_off);
+		unsigned lo = 0, hi = rp->hdr.nkeys, mid;
+		// the first keyframe is at tick 0
+		while (hi - lo > 1) {
+			mid = (lo + hi) >> 1;
+			if (index[mid].tick <= tick) lo = mid; else hi = mid;
+		}
+		if (rp->hdr.nkeys) {
+			uint64_t off = index[lo].off;
+			if (off % 8 || off < sizeof(replay_hdr_t) ||
+					off > rp->end - sizeof(replay_key_t)) ERR_EXIT("bad replay index\n");
+			pos = off;
+		}
+	} else {
+		// no index, scans the records
+		const replay_rec_t *r;
+		size_t p = pos;
+		for (; (r = replay_rec(rp, p)) && r->tick <= tick; p += replay_rec_size(r))
+			if (r->type == REPLAY_KEYFRAME) pos = p;
+	}
+	if (pos > rp->end - sizeof(*k) || (k = (const replay_key_t*)(rp->map + pos),
+			k->r.type != REPLAY_KEYFRAME)) ERR_EXIT("bad replay keyframe\n");
+	cpu_init(&rp->c, (cpu_state_t*)&k->s, rp->hdr.timer_inc);
+	rp->c.tmr_frac = k->tmr_frac;
+	rp->c.ie = k->ie;
+	replay_set_keys(&rp->c, k->r.keys);
+	rp->tick = k->r.tick;
+	rp->pos = pos + sizeof(*k);
+	while (rp->tick < tick) {
+		uint64_t n = tick - rp->tick;
+		replay_run(rom, rp, &rp->c, n < 0x10000000 ? n : 0x10000000);
+	}
+	fprintf(stderr, "replay: keyframe at %.1fs, %llu ticks emulated in %.1f ms\n",
+			(double)k->r.tick * rp->hdr.frame_usec / rp->hdr.frame_ticks * 1e-6,
+			(unsigned long long)(tick - k->r.tick), (get_time_usec() - time) * 1e-3);
+	rp->c.tickcount = 0;
+}
+
+// at the end, the keys are given back to the player
+static int replay_done(const replay_t *rp) {
+	return !replay_rec(rp, rp->pos) && rp->tick >= rp->hdr.end_tick;
+}
+
+static void run_game(const uint8_t *rom, sysctx_t *sys, cpu_state_t *s) {
+	static const uint8_t speed_mul[][2] = {
+		{ 1, 4 }, { 1, 2 }, { 1, 1 }, { 2, 1 }, { 4, 1 }, { 0, 1 } };
+	static const char * const speed_str[] = {
+		"1/4", "1/2", "1", "2", "4", "max" };
+	cpuctx_t c, ahead;
+	uint8_t *mem;
+	uint64_t last_time, redraw_time, stat_time;
+	uint32_t stat_ticks = 0, snd_ticks;
+	int stat_speed = 0;
+
+	cpu_init(&c, s, sys->timer_inc);
+	if (sys->replay_in) c = sys->replay_in->c;
+	snd_ticks = c.tickcount;
+	last_time = redraw_time = stat_time = get_time_usec();
+
+	for (;;) {
+		uint64_t new_time, delay;
+		uint32_t keys, sleep_delay;
+		int speed = __atomic_load_n(&sys->speed, __ATOMIC_RELAXED);
+		const uint8_t *mul = speed_mul[speed - SPEED_MIN];
+		// the timer and interrupts are handled by the CPU loop,
+		// which runs uninterrupted for the whole slice
+		uint32_t n = sys->sleep_ticks;
+#if USE_DEBUG
+		// the CPU is stopped until the prompt
+		if (dbg.hit) n = 0;
+#endif
+		if (n) {
+			new_time = get_time_usec();
+			if (sys->replay_in) replay_run(rom, sys->replay_in, &c, n);
+			else cpu_exec(rom, &c, n);
+			sys->run_usec += get_time_usec() - new_time;
+		}
+		new_time = get_time_usec();
+		// fast-forward skips the intermediate slices
+		if (speed <= 0 || new_time - redraw_time >= FF_REDRAW_USEC) {
+			mem = c.s.mem;
+			if (sys->runahead) {
+				// shows a copy that got the current keys a few slices earlier
+				uint64_t time = get_time_usec();
+				ahead = c;
+				cpu_run(rom, &ahead, sys->runahead * sys->sleep_ticks);
+				sys->runahead_usec += get_time_usec() - time;
+				mem = ahead.s.mem;
+			}
+			sys_redraw(sys, mem);
+			if (sys->rec) rec_frame(sys->rec, mem);
+			redraw_time = new_time;
+		}
+
+		// sound, speed control and input
+#if USE_SOUND
+		// the ticks that ran, none while the debugger stops the CPU
+		if (sys->snd)
+			sound_render(sys->snd, c.snd_num, c.snd_mode, c.snd_starts, c.tickcount - snd_ticks);
+		snd_ticks = c.tickcount;
+#endif
+
+#if CPU_TRACE
+		if (c.tickcount > 2150) {
+			// display_redraw(sys, s->mem);
+			break;
+		}
+#endif
+
+		new_time = get_time_usec();
+		if (speed != stat_speed || (speed && new_time - stat_time >= 1000000)) {
+			if (!speed) printf("\33[25;1H\33[K");
+			else if (speed != stat_speed)
+				printf("\33[25;1Hspeed x%s\33[K", speed_str[speed - SPEED_MIN]);
+			else
+				printf("\33[25;1Hspeed x%s, %.2f MIPS\33[K", speed_str[speed - SPEED_MIN],
+						(double)(c.tickcount - stat_ticks) / (new_time - stat_time));
+			stat_time = new_time;
+			stat_ticks = c.tickcount;
+			stat_speed = speed;
+		}
+		delay = new_time - last_time;
+		sleep_delay = sys->sleep_delay;
+		if (mul[0]) sleep_delay = sleep_delay * mul[1] / mul[0];
+		if (!mul[0] || delay > sleep_delay) { // unlimited or late
+			last_time = new_time;
+		} else {
+			last_time += sleep_delay;
+			// a key press starts the next slice earlier
+			last_time -= sys_sleep(sys, sleep_delay - delay);
+		}
+		keys = ~sys_events(sys);
+		if (!(keys & 0x10000)) break;
+#if USE_DEBUG
+		if (!(keys & 1 << 18)) {
+			__atomic_fetch_and(&sys->keys, ~(1 << 18), __ATOMIC_RELAXED);
+			dbg.hit = DBG_HIT_USER;
+		}
+		if (dbg.hit && dbg_prompt(rom, sys, &c)) break;
+#endif
+		if (sys->replay_in && replay_done(sys->replay_in)) sys->replay_in = NULL;
+		if (!sys->replay_in) {
+			c.pp = keys & 15;
+			c.ps = keys >> 4 & 15;
+		}
+		if (sys->replay_out) replay_slice(sys->replay_out, &c);
+	}
+
+	if (sys->replay_out) replay_finish(sys->replay_out, &c);
+	*s = c.s;
+}
+
+// Grid mode: n consoles in one terminal, each playfield is drawn with
+// half blocks (two rows per line). Only the changed lines are written,
+// all of them with one write, at most every FF_REDRAW_USEC.
+#define GRID_MAX 16
+#define GRID_W 13 // tile size with the gap
+#define GRID_H 13
+
+typedef struct {
+	cpuctx_t c;
+	uint16_t rows[20];
+	uint32_t score;
+} grid_con_t;
+
+static void run_grid(const uint8_t *rom, sysctx_t *sys, cpu_state_t *s, unsigned n) {
+	static grid_con_t con[GRID_MAX];
+	// bit 0 - top, bit 1 - bottom
+	static const char * const half[4] = {
+		" ", "\xe2\x96\x80", "\xe2\x96\x84", "\xe2\x96\x88" };
+	static char buf[16384];
+	unsigned sleep_delay = sys->sleep_delay, cols = 80 / GRID_W, i, j, len;
+	int focus = 0, old_focus = -1;
+	uint64_t last_time, stat_time, start_time, redraw_time, new_time, delay;
+	uint64_t stat_bytes = 0;
+	struct winsize ws;
+
+#define GRID_PUT(...) \
+	(len += snprintf(buf + len, sizeof(buf) - len, __VA_ARGS__))
+
+	if (!ioctl(1, TIOCGWINSZ, &ws) && ws.ws_col + 1 >= GRID_W)
+		cols = (ws.ws_col + 1) / GRID_W;
+	if (cols > n) cols = n;
+
+	printf("\33[2J\33[?25l"); // clear screen, hide cursor
+	for (i = 0; i < n; i++) {
+		unsigned x = i % cols * GRID_W + 1, y = i / cols * GRID_H + 1;
+		cpu_init(&con[i].c, s, sys->timer_inc);
+		memset(con[i].rows, 0, sizeof(con[i].rows));
+		con[i].score = ~0u;
+		printf("\33[%u;%uH+----------+", y + 1, x);
+		for (j = 0; j < 10; j++) printf("\33[%u;%uH|          |", y + 2 + j, x);
+		printf("\33[%u;%uH+----------+", y + 12, x);
+	}
+	fflush(stdout);
+	last_time = stat_time = start_time = redraw_time = get_time_usec();
+
+	for (;;) {
+		uint32_t keys = sys_events(sys);
+		if (keys & 0x10000) break;
+		focus = __atomic_load_n(&sys->focus, __ATOMIC_RELAXED) % (int)(n + 1);
+		if (focus < 0) focus += n + 1;
+
+		for (i = 0; i < n; i++) {
+			grid_con_t *g = &con[i];
+			uint32_t k = !focus || focus == (int)i + 1 ? keys : 0;
+			g->c.pp = ~k & 15;
+			g->c.ps = ~k >> 4 & 15;
+			cpu_exec(rom, &g->c, sys->sleep_ticks);
+		}
+
+		new_time = get_time_usec();
+		len = 0;
+		if (new_time - redraw_time >= FF_REDRAW_USEC || focus != old_focus)
+		for (redraw_time = new_time, i = 0; i < n; i++) {
+			grid_con_t *g = &con[i];
+			unsigned x = i % cols * GRID_W + 1, y = i / cols * GRID_H + 1;
+			uint32_t score;
+			uint16_t rows[20];
+
+			disp_rows(g->c.s.mem, rows);
+			for (j = 0; j < 20; j += 2) {
+				unsigned a = rows[j], b = rows[j + 1], m;
+				if (a == g->rows[j] && b == g->rows[j + 1]) continue;
+				GRID_PUT("\33[%u;%uH", y + 2 + j / 2, x + 1);
+				for (m = 0x200; m; m >>= 1)
+					GRID_PUT("%s", half[(a & m ? 1 : 0) | (b & m ? 2 : 0)]);
+			}
+			memcpy(g->rows, rows, sizeof(rows));
+			score = disp_score(g->c.s.mem);
+			if (score != g->score || focus != old_focus) {
+				g->score = score;
+				GRID_PUT("\33[%u;%uH%s%2u\33[m %8u", y, x,
+						focus == (int)i + 1 ? "\33[7m" : "", i + 1, score);
+			}
+		}
+		old_focus = focus;
+
+		if (new_time - stat_time >= 1000000) {
+			GRID_PUT("\33[%u;1Hkeys to %s%.0u (, and . to change), %.1f KB/s output\33[K",
+					(n + cols - 1) / cols * GRID_H + 1, focus ? "#" : "all", focus,
+					(double)stat_bytes * 1000 / (new_time - stat_time));
+			stat_time = new_time;
+			stat_bytes = 0;
+		}
+		if (len) {
+			fwrite(buf, 1, len, stdout);
+			fflush(stdout);
+			stat_bytes += len;
+			sys->grid_bytes += len;
+		}
+
+		delay = new_time - last_time;
+		if (delay > sleep_delay) { // late
+			last_time = new_time;
+		} else {
+			last_time += sleep_delay;
+			last_time -= sys_sleep(sys, sleep_delay - delay);
+		}
+	}
+#undef GRID_PUT
+	sys->grid_usec = get_time_usec() - start_time;
+	// the focused one is saved, or the first
+	*s = con[focus ? focus - 1 : 0].c.s;
+}
+
+static void run_bench(const uint8_t *rom, cpu_state_t *s,
+		sysctx_t *sys, uint64_t ticks) {
+	cpuctx_t c;
+	uint64_t time, n = ticks;
+#if MEM_STATS
+	uint64_t base_time = 0;
+#endif
+
+	cpu_init(&c, s, sys->timer_inc);
+#if MEM_STATS
+	if (mem_on) {
+		// the same ticks without the counters, to print the overhead
+		cpuctx_t c2 = c;
+		base_time = get_time_usec();
+		for (; n > 0x10000000; n -= 0x10000000)
+			cpu_run(rom, &c2, 0x10000000);
+		cpu_run(rom, &c2, n);
+		base_time = get_time_usec() - base_time;
+		n = ticks;
+	}
+#endif
+	time = get_time_usec();
+#if USE_SOUND
+	if (sys->snd) {
+		// sound is generated at the end of every time slice
+		uint32_t k = sys->sleep_ticks;
+		for (; n; n -= k) {
+			if (k > n) k = n;
+			cpu_exec(rom, &c, k);
+			sound_render(sys->snd, c.snd_num, c.snd_mode, c.snd_starts, k);
+		}
+	} else
+#endif
+	{
+		for (; n > 0x10000000; n -= 0x10000000)
+			cpu_exec(rom, &c, 0x10000000);
+		cpu_exec(rom, &c, n);
+	}
+	time = get_time_usec() - time;
+	printf("%llu ticks in %.3fs, %.2f MIPS\n", (unsigned long long)ticks,
+			time * 1e-6, time ? (double)ticks / time : 0.0);
+#if MEM_STATS
+	if (mem_on && base_time)
+		printf("without memory stats: %.3fs, %.2f MIPS, overhead %.1f%%\n",
+				base_time * 1e-6, (double)ticks / base_time,
+				100.0 * time / base_time - 100);
+#endif
+	*s = c.s;
+}
+
+// Runs n copies of the snapshot for the given number of frames (time slices),
+// keys are the sys_keys() bits for each frame of each copy.
+static void rollout_batch(const uint8_t *rom, const cpuctx_t *snap,
+		const uint8_t *keys, unsigned n, unsigned frames, unsigned frame_ticks,
+		disp_obs_t *out) {
+	cpuctx_t *c = malloc(n * sizeof(*c));
+	unsigned i, j;
+	if (!c && n) ERR_EXIT("malloc failed\n");
+	for (i = 0; i < n; i++, keys += frames) {
+		c[i] = *snap;
+		for (j = 0; j < frames; j++) {
+			c[i].pp = ~keys[j] & 15;
+			c[i].ps = ~keys[j] >> 4 & 15;
+			cpu_exec(rom, &c[i], frame_ticks);
+		}
+	}
+	// the copies are decoded in one pass
+	if (n) disp_observe(c->s.mem, sizeof(*c), n, out);
+	free(c);
+}
+
+// same letters as the keyboard controls, "." - no keys, "10a" - repeat
+static int script_parse(const char *str, uint8_t *keys, unsigned frames) {
+	unsigned i = 0, k;
+	for (; *str && *str != '\n'; str++) {
+		int a = *str, rep = 1;
+		if (a >= '0' && a <= '9') {
+			char *end;
+			rep = strtol(str, &end, 10);
+			a = *(str = end);
+		}
+		switch (a | 32) {
+		case '.': k = 0; break;
+		case 'w': k = 1; break; // rotate
+		case 's': k = 2; break; // down
+		case 'd': k = 4; break; // right
+		case 'a': k = 8; break; // left
+		case 'p': k = 0x10; break; // start/pause
+		case 'm': k = 0x20; break; // mute
+		case 'r': k = 0x40; break; // on/off
+		default: return -1;
+		}
+		for (; rep > 0 && i < frames; rep--) keys[i++] = k;
+	}
+	while (i < frames) keys[i++] = 0;
+	return 0;
+}
+
+static void run_rollouts(const uint8_t *rom, cpu_state_t *s, const char *fn,
+		unsigned frames, unsigned frame_ticks, unsigned timer_inc) {
+	cpuctx_t snap;
+	uint8_t *keys = NULL;
+	disp_obs_t *out;
+	unsigned i, n = 0, max = 0;
+	uint64_t time;
+	char line[4096];
+	FILE *f = fopen(fn, "r");
+	if (!f) ERR_EXIT("fopen failed\n");
+	while (fgets(line, sizeof(line), f)) {
+		if (n == max) {
+			max = max ? max * 2 : 256;
+			keys = realloc(keys, (size_t)max * frames);
+			if (!keys) ERR_EXIT("realloc failed\n");
+		}
+		if (script_parse(line, keys + (size_t)n * frames, frames))
+			ERR_EXIT("bad script at line %u\n", n + 1);
+		n++;
+	}
+	fclose(f);
+
+	out = malloc(n * sizeof(*out));
+	if (!out) ERR_EXIT("malloc failed\n");
+	disp_init();
+	cpu_init(&snap, s, timer_inc);
+	time = get_time_usec();
+	rollout_batch(rom, &snap, keys, n, frames, frame_ticks, out);
+	time = get_time_usec() - time;
+	for (i = 0; i < n; i++)
+		printf("%u %u %u\n", i, out[i].score, (unsigned)out[i].flags & 1);
+	fprintf(stderr, "%u rollouts in %.3fs\n", n, time * 1e-6);
+	free(out);
+	free(keys);
+}
+
+// Autoplayer for Tetris: each placement (rotation and shift) is played on
+// a copy of the console, so the game itself is the model, and the copy
+// with the best playfield becomes the new state.
+
+#define AP_HOLD 3 // slices a key is held
+#define AP_GAP 3 // slices after releasing
+#define AP_DROP 3000 // slices to wait for the next piece
+#define AP_SHIFT 6 // shifts in each direction
+#define AP_GAME_OVER(mem) ((mem)[177] >> 1 & 1) // disp_item[0]
+
+typedef struct {
+	const uint8_t *rom;
+	unsigned frame_ticks;
+	uint64_t ticks; // including the search
+} autoplay_t;
+
+static void ap_run(autoplay_t *ap, cpuctx_t *c, unsigned keys, unsigned n) {
+	c->pp = ~keys & 15;
+	c->ps = ~keys >> 4 & 15;
+	ap->ticks += (uint64_t)n * ap->frame_ticks;
+	for (; n; n--) cpu_exec(ap->rom, c, ap->frame_ticks);
+	c->pp = c->ps = 15;
+}
+
+static void ap_press(autoplay_t *ap, cpuctx_t *c, unsigned keys) {
+	ap_run(ap, c, keys, AP_HOLD);
+	ap_run(ap, c, 0, AP_GAP);
+}
+
+// holds down until the next piece appears or the game is over
+static void ap_drop(autoplay_t *ap, cpuctx_t *c) {
+	unsigned next = disp_next(c->s.mem), i;
+	c->pp = ~2 & 15;
+	for (i = 0; i < AP_DROP; i++) {
+		cpu_exec(ap->rom, c, ap->frame_ticks);
+		ap->ticks += ap->frame_ticks;
+		if (disp_next(c->s.mem) != next || AP_GAME_OVER(c->s.mem)) break;
+	}
+	c->pp = 15;
+}
+
+// bigger is better: the score gained, minus height, holes and bumpiness,
+// the two top rows are skipped, the new piece is there
+static int64_t ap_eval(const uint8_t *mem, uint32_t score0) {
+	uint16_t rows[20];
+	int i, j, height = 0, holes = 0, bump = 0, prev = -1;
+	if (AP_GAME_OVER(mem)) return INT64_MIN;
+	disp_rows(mem, rows);
+	for (j = 0; j < 10; j++) {
+		int h = 0;
+		for (i = 2; i < 20; i++) {
+			if (rows[i] >> (9 - j) & 1) {
+				if (!h) h = 20 - i;
+			} else if (h) holes++;
+		}
+		height += h;
+		if (prev >= 0) bump += h > prev ? h - prev : prev - h;
+		prev = h;
+	}
+	return (int64_t)(disp_score(mem) - score0) * 8 - height * 51 - holes * 36 - bump * 18;
+}
+
+static void ap_search(autoplay_t *ap, cpuctx_t *c) {
+	cpuctx_t best, base, m, t;
+	int64_t best_val = 0;
+	uint32_t score0 = disp_score(c->s.mem);
+	int r, dir, k, found = 0;
+
+	for (r = 0; r < 4; r++) {
+		base = *c;
+		for (k = 0; k < r; k++) ap_press(ap, &base, 1);
+		for (dir = -1; dir <= 1; dir += 2) {
+			m = base;
+			for (k = dir < 0 ? 0 : 1; k <= AP_SHIFT; k++) {
+				int64_t val;
+				if (k) ap_press(ap, &m, dir < 0 ? 8 : 4);
+				t = m;
+				ap_drop(ap, &t);
+				val = ap_eval(t.s.mem, score0);
+				if (!found || val > best_val)
+					best = t, best_val = val, found = 1;
+			}
+		}
+	}
+	*c = best;
+}
+
+static void run_autoplay(const uint8_t *rom, cpu_state_t *s, unsigned pieces,
+		unsigned frame_ticks, unsigned timer_inc) {
+	autoplay_t ap;
+	cpuctx_t c;
+	uint64_t time;
+	uint32_t score = 0, best = 0;
+	unsigned i, games = 0;
+
+	ap.rom = rom; ap.frame_ticks = frame_ticks; ap.ticks = 0;
+	disp_init();
+	cpu_init(&c, s, timer_inc);
+	time = get_time_usec();
+	for (i = 0; i < pieces; i++) {
+		if (AP_GAME_OVER(c.s.mem)) {
+			// restarts with the same settings
+			score = disp_score(c.s.mem);
+			if (best < score) best = score;
+			games++;
+			ap_press(&ap, &c, 0x10);
+			ap_run(&ap, &c, 0, 100);
+		}
+		ap_search(&ap, &c);
+	}
+	time = get_time_usec() - time;
+	score = disp_score(c.s.mem);
+	if (best < score) best = score;
+	printf("%u pieces, %u games over, best score %u\n", pieces, games, best);
+	fprintf(stderr, "%.3fs, %.1f pieces/s, %llu ticks, %.2f MIPS\n", time * 1e-6,
+			time ? pieces * 1e6 / time : 0.0, (unsigned long long)ap.ticks,
+			time ? (double)ap.ticks / time : 0.0);
+	*s = c.s;
+}
+
+// Differential testing: every backend runs the same seeds
+// and must end each time slice in the same state as the reference.
+
+typedef uint32_t (*cpu_backend_t)(const uint8_t *rom, cpuctx_t *c, uint32_t ticks);
+
+// one instruction per call (nothing fused), the same loop otherwise
+static uint32_t cpu_run_step(const uint8_t *rom, cpuctx_t *c, uint32_t ticks) {
+	for (; ticks && !c->err; ticks--) cpu_run(rom, c, 1);
+	return ticks;
+}
+
+// shared - updates the global cov_map[] or mem_reads[]/mem_writes[],
+// such backends don't run concurrently
+static const struct {
+	const char *name; cpu_backend_t run; int shared;
+} diff_backend[] = {
+	{ "step", cpu_run_step, 0 },
+	{ "run", cpu_run, 0 },
+	{ "cov", cpu_run_cov, 1 },
+#if MEM_STATS
+	{ "mem", cpu_run_mem, 1 },
+#endif
+#if USE_DEBUG
+	{ "debug", cpu_run_debug, 1 },
+#endif
+};
+
+#define DIFF_BACKENDS (int)(sizeof(diff_backend) / sizeof(*diff_backend))
+
+// prints the first difference, returns 0 if the states are equal
+static int diff_state(const cpuctx_t *x, const cpuctx_t *y, char *buf, size_t n) {
+	const cpu_state_t *s = &x->s, *t = &y->s;
+	unsigned i;
+#define X(name, a, b) if ((a) != (b)) \
+	return snprintf(buf, n, "%s %x != %x", name, (unsigned)(a), (unsigned)(b)), 1;
+	X("pc", s->pc, t->pc) X("a", s->a, t->a) X("cf", s->cf, t->cf)
+	for (i = 0; i < 5; i++) {
+		static const char * const reg[5] = { "r0", "r1", "r2", "r3", "r4" };
+		X(reg[i], s->r[i], t->r[i])
+	}
+	X("stack", s->stack, t->stack) X("tmr", s->tmr, t->tmr)
+	X("tf", s->tf, t->tf) X("timer_en", s->timer_en, t->timer_en)
+	for (i = 0; i < 256; i++)
+		if (s->mem[i] != t->mem[i])
+			return snprintf(buf, n, "mem[%02x] %x != %x", i, s->mem[i], t->mem[i]), 1;
+	X("tmr_frac", x->tmr_frac, y->tmr_frac) X("tickcount", x->tickcount, y->tickcount)
+	X("pa", x->pa, y->pa) X("snd_num", x->snd_num, y->snd_num)
+	X("snd_mode", x->snd_mode, y->snd_mode) X("snd_starts", x->snd_starts, y->snd_starts)
+	X("ie", x->ie, y->ie) X("err", x->err, y->err)
+#undef X
+#if CPU_HASH
+	// the incremental hash must match the memory
+	if (x->mem_hash != cpu_mem_hash(&x->s) || y->mem_hash != cpu_mem_hash(&y->s))
+		return snprintf(buf, n, "stale mem_hash"), 1;
+#endif
+	return 0;
+}
+
+typedef struct {
+	const uint8_t *rom;
+	const cpu_state_t *init; // NULL for random states
+	unsigned seeds, frames, frame_ticks, timer_inc;
+	unsigned next, failed;
+	pthread_mutex_t lock; // for the shared backends
+} difftest_t;
+
+static void diff_run(difftest_t *dt, int i, cpuctx_t *c, uint32_t ticks) {
+	if (!diff_backend[i].shared) {
+		diff_backend[i].run(dt->rom, c, ticks);
+		return;
+	}
+	pthread_mutex_lock(&dt->lock);
+	diff_backend[i].run(dt->rom, c, ticks);
+	pthread_mutex_unlock(&dt->lock);
+}
+
+static uint32_t diff_rand(uint32_t *x) {
+	uint32_t a = *x;
+	a ^= a << 13; a ^= a >> 17; a ^= a << 5;
+	return *x = a;
+}
+
+// returns 1 and prints the report if a backend diverged
+static int difftest_seed(difftest_t *dt, unsigned seed) {
+	const uint8_t *rom = dt->rom;
+	cpuctx_t c[DIFF_BACKENDS], prev[DIFF_BACKENDS];
+	cpu_state_t s;
+	uint32_t rnd = seed * 0x9e3779b9 + 1, keys = 0;
+	unsigned frame, hold = 0;
+	int i;
+
+	if (dt->init) s = *dt->init;
+	else {
+		for (i = 0; i < 256; i++) s.mem[i] = diff_rand(&rnd) & 15;
+		s.pc = diff_rand(&rnd) & 0xfff;
+		s.stack = diff_rand(&rnd) & 0xfff;
+		s.a = diff_rand(&rnd) & 15;
+		for (i = 0; i < 5; i++) s.r[i] = diff_rand(&rnd) & 15;
+		i = diff_rand(&rnd);
+		s.cf = i & 1; s.tf = i >> 1 & 1; s.timer_en = i >> 2 & 1;
+		s.tmr = i >> 8;
+	}
+	for (i = 0; i < DIFF_BACKENDS; i++) cpu_init(&c[i], &s, dt->timer_inc);
+
+	for (frame = 0; frame < dt->frames; frame++) {
+		char buf[64];
+		// holds a random key (or none) for a random number of slices
+		if (!hold) {
+			hold = 16 + (diff_rand(&rnd) & 63);
+			i = diff_rand(&rnd) & 7;
+			keys = i < 7 ? 1 << i : 0;
+		}
+		hold--;
+		for (i = 0; i < DIFF_BACKENDS; i++) {
+			prev[i] = c[i];
+			c[i].pp = ~keys & 15;
+			c[i].ps = ~keys >> 4 & 15;
+			diff_run(dt, i, &c[i], dt->frame_ticks);
+		}
+		for (i = 1; i < DIFF_BACKENDS; i++) {
+			cpuctx_t x, y;
+			unsigned k;
+			if (!diff_state(&c[0], &c[i], buf, sizeof(buf))) continue;
+			// find the first tick that differs
+			for (k = 1; k <= dt->frame_ticks; k++) {
+				x = prev[0]; y = prev[i];
+				x.pp = y.pp = c[0].pp;
+				x.ps = y.ps = c[0].ps;
+				diff_run(dt, 0, &x, k - 1);
+				s = x.s;
+				diff_run(dt, 0, &x, 1);
+				diff_run(dt, i, &y, k);
+				if (diff_state(&x, &y, buf, sizeof(buf))) break;
+			}
+			if (k > dt->frame_ticks) {
+				printf("seed %u: %s differs from %s at slice %u, "
+						"not reproduced per tick\n", seed, diff_backend[i].name,
+						diff_backend[0].name, frame);
+				return 1;
+			}
+			printf("seed %u: %s differs from %s at slice %u, tick %u, "
+					"pc=%03x (op %02x): %s\n", seed, diff_backend[i].name,
+					diff_backend[0].name, frame, k, s.pc, rom[s.pc], buf);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void *difftest_thread(void *arg) {
+	difftest_t *dt = arg;
+	for (;;) {
+		unsigned seed = __atomic_fetch_add(&dt->next, 1, __ATOMIC_RELAXED);
+		if (seed >= dt->seeds) break;
+		if (difftest_seed(dt, seed))
+			__atomic_fetch_add(&dt->failed, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+// returns the number of failed seeds
+static unsigned run_difftest(const uint8_t *rom, const cpu_state_t *init,
+		unsigned seeds, unsigned jobs, unsigned frames,
+		unsigned frame_ticks, unsigned timer_inc) {
+	difftest_t dt;
+	pthread_t *th;
+	uint64_t time;
+	unsigned i;
+
+	dt.rom = rom; dt.init = init;
+	dt.seeds = seeds; dt.frames = frames;
+	dt.frame_ticks = frame_ticks; dt.timer_inc = timer_inc;
+	dt.next = dt.failed = 0;
+	pthread_mutex_init(&dt.lock, NULL);
+	if (!jobs) jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (!jobs) jobs = 1;
+	th = malloc(jobs * sizeof(*th));
+	if (!th) ERR_EXIT("malloc failed\n");
+
+	time = get_time_usec();
+	for (i = 0; i < jobs; i++)
+		if (pthread_create(&th[i], NULL, difftest_thread, &dt))
+			ERR_EXIT("pthread_create failed\n");
+	for (i = 0; i < jobs; i++) pthread_join(th[i], NULL);
+	time = get_time_usec() - time;
+	free(th);
+	pthread_mutex_destroy(&dt.lock);
+
+	fprintf(stderr, "%u seeds, %u backends, %u failed, %u threads, %.3fs\n",
+			seeds, DIFF_BACKENDS, dt.failed, jobs, time * 1e-6);
+	return dt.failed;
+}
+
+// Instant start: the state after choosing the game, speed and level
+// in the menu is cached in a file next to the ROM, keyed by the ROM hash.
+
+#define NAV_TICKS 1000 // ticks per time slice
+#define NAV_BOOT 300 // slices from power on to the menu
+#define NAV_HOLD 5 // slices a key is held
+#define NAV_WAIT 20 // slices after a key is released
+#define NAV_START 100 // slices after the start key
+#define NAV_MAX 32 // presses to reach a speed or level
+
+#define SNAP_VERSION 1
+
+// Only cpu_state_t is kept, like in save files: the timer fraction
+// (tmr_frac) starts from 0, for a cached and a fresh start alike.
+typedef struct {
+	uint8_t game, speed, level; // 255 - not chosen
+	uint8_t version;
+	uint32_t timer_inc; // the real increment, not the -i divisor
+	cpu_state_t s;
+} snap_rec_t;
+
+// keys are the sys_keys() bits, 0 - wait with no keys
+static void nav_press(const uint8_t *rom, cpuctx_t *c, unsigned keys, unsigned n) {
+	c->pp = ~keys & 15;
+	c->ps = ~keys >> 4 & 15;
+	for (; n; n--) cpu_run(rom, c, NAV_TICKS);
+	c->pp = c->ps = 15;
+}
+
+static void nav_step(const uint8_t *rom, cpuctx_t *c, unsigned keys) {
+	nav_press(rom, c, keys, NAV_HOLD);
+	nav_press(rom, c, 0, NAV_WAIT);
+}
+
+// The key layout of the menu isn't hardcoded, the keys are tried on copies:
+// the speed and level keys change the displayed number,
+// the game key changes the playfield only.
+static unsigned nav_find_key(const uint8_t *rom, const cpuctx_t *c,
+		int off, unsigned used) {
+	static const uint8_t keys[] = { 1, 2, 4, 8 }; // rotate, down, right, left
+	uint16_t rows[20], rows2[20];
+	unsigned i;
+	disp_rows(c->s.mem, rows);
+	for (i = 0; i < sizeof(keys); i++) {
+		cpuctx_t t = *c;
+		if (keys[i] & used) continue;
+		nav_step(rom, &t, keys[i]);
+		if (off) {
+			if (disp_num(t.s.mem, off) != disp_num(c->s.mem, off)) return keys[i];
+			continue;
+		}
+		disp_rows(t.s.mem, rows2);
+		if (disp_num(t.s.mem, 196) == disp_num(c->s.mem, 196) &&
+				disp_num(t.s.mem, 204) == disp_num(c->s.mem, 204) &&
+				memcmp(rows, rows2, sizeof(rows))) return keys[i];
+	}
+	return 0;
+}
+
+static void nav_select(const uint8_t *rom, cpuctx_t *c, snap_rec_t *r) {
+	unsigned speed_key, level_key, game_key, i;
+
+	cpu_init(c, &r->s, r->timer_inc);
+	disp_init();
+	nav_press(rom, c, 0, NAV_BOOT);
+	speed_key = nav_find_key(rom, c, 196, 0);
+	level_key = nav_find_key(rom, c, 204, speed_key);
+	game_key = nav_find_key(rom, c, 0, speed_key | level_key);
+	if (r->game != 255 && r->game) {
+		if (!game_key) ERR_EXIT("menu: no key changes the game\n");
+		for (i = 0; i < r->game; i++) nav_step(rom, c, game_key);
+	}
+	if (r->speed != 255) {
+		if (!speed_key) ERR_EXIT("menu: no key changes the speed\n");
+		for (i = 0; disp_num(c->s.mem, 196) != r->speed; i++) {
+			if (i == NAV_MAX) ERR_EXIT("menu: can't choose speed %u\n", r->speed);
+			nav_step(rom, c, speed_key);
+		}
+	}
+	if (r->level != 255) {
+		if (!level_key) ERR_EXIT("menu: no key changes the level\n");
+		for (i = 0; disp_num(c->s.mem, 204) != r->level; i++) {
+			if (i == NAV_MAX) ERR_EXIT("menu: can't choose level %u\n", r->level);
+			nav_step(rom, c, level_key);
+		}
+	}
+	nav_press(rom, c, 0x10, NAV_HOLD);
+	nav_press(rom, c, 0, NAV_START);
+	r->s = c->s;
+}
+
+// loads the state from the cache or builds it and adds to the cache
+static void snap_cache(const uint8_t *rom, const char *rom_fn,
+		int game, int speed, int level, unsigned timer_inc, cpu_state_t *s) {
+	char fn[4096];
+	snap_rec_t r, key;
+	cpuctx_t c;
+	FILE *f;
+
+	memset(&key, 0, sizeof(key));
+	key.game = game < 0 ? 255 : game;
+	key.speed = speed < 0 ? 255 : speed;
+	key.level = level < 0 ? 255 : level;
+	key.version = SNAP_VERSION;
+	key.timer_inc = timer_inc;
+	if ((unsigned)snprintf(fn, sizeof(fn), "%s.%016llx.snap", rom_fn,
+			(unsigned long long)rom_hash(rom)) >= sizeof(fn))
+		ERR_EXIT("ROM path is too long\n");
+
+	f = fopen(fn, "rb");
+	if (f) {
+		while (fread(&r, 1, sizeof(r), f) == sizeof(r))
+			if (!memcmp(&r, &key, offsetof(snap_rec_t, s)) && !check_state(&r.s)) {
+				fclose(f);
+				*s = r.s;
+				return;
+			}
+		fclose(f);
+	}
+
+	nav_select(rom, &c, &key);
+	// the broken state must not get into the cache
+	if (c.err) ERR_EXIT("menu: unknown opcode at 0x%03x\n", c.s.pc);
+	f = fopen(fn, "ab");
+	if (!f || fwrite(&key, 1, sizeof(key), f) != sizeof(key))
+		fprintf(stderr, "can't write %s\n", fn);
+	if (f) fclose(f);
+	*s = key.s;
+}
+
+// Server mode: every client of a UNIX seqpacket socket gets its own console.
+// Input: one byte per key event, key number (bit numbers of sys_keys)
+// with bit 7 set for press and clear for release.
+// Output: 'F', nrows, nsegs, then nrows * (row, bits:16le)
+// and nsegs * (offset, value) for the changed display memory
+// at DISP_CHECK_START + offset. Nothing is sent if nothing changed.
+
+#ifndef SERVER_MAX
+#define SERVER_MAX 1024
+#endif
+
+typedef struct {
+	cpuctx_t c;
+	int fd;
+	uint32_t keys;
+	uint16_t rows[20];
+	uint8_t mem[DISP_CHECK_SIZE];
+} session_t;
+
+static volatile sig_atomic_t server_stop;
+static void server_signal(int sig) { (void)sig; server_stop = 1; }
+
+static void session_keys(session_t *ss) {
+	uint8_t buf[64];
+	int i, n = recv(ss->fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (n <= 0) {
+		if (n < 0 && errno == EAGAIN) return;
+		close(ss->fd); ss->fd = -1;
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		unsigned a = buf[i], key = a & 7;
+		if (key > 6) continue;
+		if (a & 0x80) ss->keys |= 1 << key;
+		else ss->keys &= ~(1 << key);
+	}
+	ss->c.pp = ~ss->keys & 15;
+	ss->c.ps = ~ss->keys >> 4 & 15;
+}
+
+static void session_frame(session_t *ss) {
+	uint8_t buf[3 + 20 * 3 + DISP_CHECK_SIZE * 2], *d = buf + 3;
+	uint16_t rows[20];
+	const uint8_t *mem = ss->c.s.mem;
+	unsigned i, nrows = 0, nsegs = 0;
+
+	disp_rows(mem, rows);
+	for (i = 0; i < 20; i++) {
+		unsigned a = rows[i];
+		if (a == ss->rows[i]) continue;
+		*d++ = i; *d++ = a; *d++ = a >> 8; nrows++;
+	}
+	for (i = 0; i < DISP_CHECK_SIZE; i++) {
+		unsigned a = mem[i + DISP_CHECK_START];
+		if (a == ss->mem[i]) continue;
+		*d++ = i; *d++ = a; nsegs++;
+	}
+	if (!(nrows | nsegs)) return;
+	buf[0] = 'F'; buf[1] = nrows; buf[2] = nsegs;
+	// if the client is slow, the changes go to the next frame
+	if (send(ss->fd, buf, d - buf, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+		if (errno != EAGAIN) close(ss->fd), ss->fd = -1;
+		return;
+	}
+	memcpy(ss->rows, rows, sizeof(rows));
+	memcpy(ss->mem, mem + DISP_CHECK_START, DISP_CHECK_SIZE);
+}
+
+static void run_server(const uint8_t *rom, const char *path, cpu_state_t *init,
+		unsigned sleep_ticks, unsigned sleep_delay, unsigned timer_inc) {
+	static session_t *list[SERVER_MAX];
+	static struct pollfd fds[SERVER_MAX + 1];
+	struct sockaddr_un addr;
+	unsigned i, n = 0;
+	uint64_t next_time;
+	int lfd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) ERR_EXIT("socket path is too long\n");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	lfd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (lfd < 0) ERR_EXIT("socket failed\n");
+	unlink(path);
+	if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)))
+		ERR_EXIT("bind failed\n");
+	if (listen(lfd, 16)) ERR_EXIT("listen failed\n");
+
+	signal(SIGINT, server_signal);
+	signal(SIGTERM, server_signal);
+	next_time = get_time_usec();
+
+	while (!server_stop) {
+		uint64_t time = get_time_usec();
+		int timeout = 0;
+		if (time < next_time) timeout = (next_time - time + 999) / 1000;
+
+		fds[0].fd = lfd; fds[0].events = POLLIN;
+		for (i = 0; i < n; i++)
+			fds[i + 1].fd = list[i]->fd, fds[i + 1].events = POLLIN;
+		if (poll(fds, n + 1, timeout) < 0 && errno != EINTR)
+			ERR_EXIT("poll failed\n");
+
+		for (i = 0; i < n; i++)
+			if (fds[i + 1].revents) session_keys(list[i]);
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(lfd, NULL, NULL);
+			if (fd >= 0) {
+				session_t *ss;
+				if (n == SERVER_MAX || !(ss = malloc(sizeof(*ss)))) close(fd);
+				else {
+					cpu_init(&ss->c, init, timer_inc);
+					ss->fd = fd;
+					ss->keys = 0;
+					// the first frame has everything
+					memset(ss->rows, -1, sizeof(ss->rows));
+					memset(ss->mem, -1, sizeof(ss->mem));
+					list[n++] = ss;
+				}
+			}
+		}
+
+		time = get_time_usec();
+		if (time < next_time) continue;
+		next_time += sleep_delay;
+		// too late, skips the missed slices
+		if ((int64_t)(time - next_time) > 100000) next_time = time;
+
+		for (i = 0; i < n; i++) {
+			session_t *ss = list[i];
+			if (ss->fd >= 0) {
+				cpu_exec(rom, &ss->c, sleep_ticks);
+				session_frame(ss);
+			}
+			if (ss->fd < 0) {
+				free(ss);
+				list[i--] = list[--n];
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++) close(list[i]->fd), free(list[i]);
+	close(lfd);
+	unlink(path);
+}
+
+// Rollback netplay: two consoles in lockstep, one for each player.
+// Both processes run both consoles: the local one with the keys as they
+// are pressed, and the remote one twice: "conf" with the received keys
+// only, "pred" up to the current frame with the last received keys
+// repeated. When the received keys differ from the predicted ones,
+// "pred" is copied from "conf" and re-simulated. The local console
+// never rolls back, its keys are always known.
+#define NET_WIN_MAX 64 // max frames ahead of the peer
+#define NET_INPUTS (NET_WIN_MAX * 2) // max keys per packet
+#define NET_RING 256 // frames of history
+#define NET_TIMEOUT 10000000 // usec without packets
+#define NET_HDR 23
+
+typedef struct {
+	int fd;
+	unsigned win, loss; // loss: percent of packets dropped, for testing
+	uint32_t seed;
+	uint32_t frame; // local frames done
+	uint32_t remote; // remote keys known for frames < remote
+	uint32_t conf; // frames of the remote console confirmed
+	uint32_t ack; // local keys the peer has
+	int got, quit;
+	uint64_t recv_time;
+	cpuctx_t local, conf_c, pred;
+	uint8_t keys[NET_RING], rkeys[NET_RING], pkeys[NET_RING];
+	uint64_t hash[NET_RING], chash[NET_RING], rhash[NET_RING];
+	uint32_t rhash_frame[NET_RING];
+	// stats
+	unsigned rollbacks, rollback_max, stalls, desyncs;
+	uint32_t desync_frame;
+	uint64_t rollback_frames, rollback_usec, rollback_usec_max;
+} netplay_t;
+
+static uint64_t net_hash(const cpuctx_t *c) {
+#if CPU_HASH
+	return cpu_hash(c);
+#else
+	const uint8_t *p = (const uint8_t*)&c->s;
+	uint64_t h = 0xcbf29ce484222325; // FNV-1a
+	unsigned i;
+	for (i = 0; i < sizeof(c->s); i++) h = (h ^ p[i]) * 0x100000001b3;
+	return (h ^ c->tmr_frac) * 0x100000001b3;
+#endif
+}
+
+// "local:host:port", the local port, then the address of the peer
+static void net_open(netplay_t *net, const char *spec) {
+	struct addrinfo hints, *peer, *self;
+	char host[256], lport[16];
+	const char *p = strchr(spec, ':'), *q = strrchr(spec, ':');
+	int one = 1;
+
+	if (!p || p == q || p - spec >= (int)sizeof(lport) ||
+			q - p - 1 >= (int)sizeof(host)) ERR_EXIT("bad netplay address\n");
+	memcpy(lport, spec, p - spec); lport[p - spec] = 0;
+	memcpy(host, p + 1, q - p - 1); host[q - p - 1] = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(host, q + 1, &hints, &peer))
+		ERR_EXIT("can't resolve \"%s\"\n", host);
+	hints.ai_family = peer->ai_family;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(NULL, lport, &hints, &self))
+		ERR_EXIT("bad local port\n");
+
+	net->fd = socket(peer->ai_family, SOCK_DGRAM, 0);
+	if (net->fd < 0) ERR_EXIT("socket failed\n");
+	setsockopt(net->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(net->fd, self->ai_addr, self->ai_addrlen))
+		ERR_EXIT("bind failed\n");
+	// only the peer's packets are received
+	if (connect(net->fd, peer->ai_addr, peer->ai_addrlen))
+		ERR_EXIT("connect failed\n");
+	fcntl(net->fd, F_SETFL, O_NONBLOCK);
+	freeaddrinfo(peer);
+	freeaddrinfo(self);
+}
+
+static void net_put32(uint8_t *p, uint32_t a) {
+	p[0] = a; p[1] = a >> 8; p[2] = a >> 16; p[3] = a >> 24;
+}
+
+static uint32_t net_get32(const uint8_t *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// 'N', quit, ack, first, count, hash frame, hash, keys[count]
+static void net_send(netplay_t *net, int quit) {
+	uint8_t buf[NET_HDR + NET_INPUTS];
+	uint32_t first = net->ack, n = net->frame - first, i;
+	if (n > NET_INPUTS) first += n - NET_INPUTS, n = NET_INPUTS;
+	buf[0] = 'N'; buf[1] = quit;
+	net_put32(buf + 2, net->remote);
+	net_put32(buf + 6, first);
+	buf[10] = n;
+	// the hash of the local console after the last frame
+	net_put32(buf + 11, net->frame - 1);
+	net_put32(buf + 15, net->hash[(net->frame - 1) % NET_RING]);
+	net_put32(buf + 19, net->hash[(net->frame - 1) % NET_RING] >> 32);
+	for (i = 0; i < n; i++) buf[NET_HDR + i] = net->keys[(first + i) % NET_RING];
+	if (net->loss && diff_rand(&net->seed) % 100 < net->loss) return;
+	// errors are lost packets, ECONNREFUSED until the peer starts
+	if (send(net->fd, buf, NET_HDR + n, 0)) {}
+}
+
+static void net_check(netplay_t *net, uint32_t f, uint64_t h) {
+	if (h == net->chash[f % NET_RING]) return;
+	if (!net->desyncs++) net->desync_frame = f;
+}
+
+static void net_recv(netplay_t *net) {
+	uint8_t buf[NET_HDR + NET_INPUTS];
+	int len;
+	while ((len = recv(net->fd, buf, sizeof(buf), 0)) >= 0 || errno == ECONNREFUSED) {
+		uint32_t ack, first, n, f, end, i;
+		uint64_t h;
+		if (len < NET_HDR || buf[0] != 'N') continue;
+		n = buf[10];
+		if (len != NET_HDR + (int)n) continue;
+		net->got = 1;
+		net->recv_time = get_time_usec();
+		if (buf[1]) net->quit = 1;
+		ack = net_get32(buf + 2);
+		first = net_get32(buf + 6);
+		if ((int32_t)(ack - net->ack) > 0 && ack <= net->frame) net->ack = ack;
+		// packets can come out of order, the keys must be contiguous
+		end = first + n;
+		if ((int32_t)(first - net->remote) <= 0 && (int32_t)(end - net->remote) > 0) {
+			for (i = net->remote; i != end; i++)
+				net->rkeys[i % NET_RING] = buf[NET_HDR + i - first];
+			net->remote = end;
+		}
+		f = net_get32(buf + 11);
+		h = net_get32(buf + 15) | (uint64_t)net_get32(buf + 19) << 32;
+		if ((int32_t)(f - net->conf) >= NET_RING / 2 ||
+				(int32_t)(net->conf - f) > NET_RING / 2) continue;
+		// checked now if confirmed, or when it's confirmed
+		if (f < net->conf) net_check(net, f, h);
+		else net->rhash[f % NET_RING] = h, net->rhash_frame[f % NET_RING] = f;
+	}
+}
+
+// runs frame f, keys are the sys_keys() bits
+static void net_run(const uint8_t *rom, cpuctx_t *c, unsigned keys,
+		uint32_t f, unsigned frame_ticks) {
+	int32_t n = (f + 1) * frame_ticks - c->tickcount;
+	c->pp = ~keys & 15;
+	c->ps = ~keys >> 4 & 15;
+	if (n > 0) cpu_exec(rom, c, n);
+}
+
+// the last known keys of the peer
+static unsigned net_predict(const netplay_t *net) {
+	return net->remote ? net->rkeys[(net->remote - 1) % NET_RING] : 0;
+}
+
+static void net_step(const uint8_t *rom, netplay_t *net, unsigned keys,
+		unsigned frame_ticks) {
+	uint32_t f = net->frame;
+	unsigned k = f < net->remote ? net->rkeys[f % NET_RING] : net_predict(net);
+	net->keys[f % NET_RING] = keys;
+	net_run(rom, &net->local, keys, f, frame_ticks);
+	net->hash[f % NET_RING] = net_hash(&net->local);
+	net->pkeys[f % NET_RING] = k;
+	net_run(rom, &net->pred, k, f, frame_ticks);
+	net->frame = f + 1;
+}
+
+// confirms the frames with known keys, rolls back on a wrong prediction
+static void net_sync(const uint8_t *rom, netplay_t *net, unsigned frame_ticks) {
+	int miss = 0;
+	uint32_t f;
+	uint64_t time;
+	while (net->conf < net->remote && net->conf < net->frame) {
+		unsigned k = net->rkeys[(f = net->conf++) % NET_RING];
+		if (k != net->pkeys[f % NET_RING]) miss = 1;
+		net_run(rom, &net->conf_c, k, f, frame_ticks);
+		net->chash[f % NET_RING] = net_hash(&net->conf_c);
+		if (net->rhash_frame[f % NET_RING] == f)
+			net_check(net, f, net->rhash[f % NET_RING]);
+	}
+	if (!miss) return;
+	time = get_time_usec();
+	net->pred = net->conf_c;
+	for (f = net->conf; f < net->frame; f++) {
+		unsigned k = net_predict(net);
+		net->pkeys[f % NET_RING] = k;
+		net_run(rom, &net->pred, k, f, frame_ticks);
+	}
+	time = get_time_usec() - time;
+	f = net->frame - net->conf;
+	net->rollbacks++;
+	net->rollback_frames += f;
+	if (net->rollback_max < f) net->rollback_max = f;
+	net->rollback_usec += time;
+	if (net->rollback_usec_max < time) net->rollback_usec_max = time;
+}
+
+static void run_netplay(const uint8_t *rom, sysctx_t *sys, cpu_state_t *s,
+		netplay_t *net) {
+	uint64_t last_time, stat_time, new_time, delay;
+	unsigned frame_ticks = sys->sleep_ticks, sleep_delay = sys->sleep_delay;
+	uint32_t keys;
+
+	cpu_init(&net->local, s, sys->timer_inc);
+	net->conf_c = net->pred = net->local;
+	// rhash_frame must not match the frames before they're received
+	memset(net->rhash_frame, -1, sizeof(net->rhash_frame));
+	net->seed = get_time_usec() | 1;
+	last_time = stat_time = get_time_usec();
+
+	for (;;) {
+		net_recv(net);
+		new_time = get_time_usec();
+		if (net->quit) break;
+		if (net->got && new_time - net->recv_time > NET_TIMEOUT) break;
+		if (new_time - stat_time >= 1000000) {
+			if (!net->got) printf("\33[25;1Hwaiting for the peer\33[K");
+			else printf("\33[25;1Hpeer score %u, %d frames ahead, rollbacks %u (max %u frames, %u us)%s\33[K",
+					disp_score(net->pred.s.mem), (int)(net->frame - net->remote),
+					net->rollbacks, net->rollback_max, (unsigned)net->rollback_usec_max,
+					net->desyncs ? ", DESYNC" : "");
+			fflush(stdout);
+			stat_time = new_time;
+		}
+
+		keys = sys_events(sys);
+		if (keys & 0x10000) break;
+		// too far ahead, waits for the peer's keys,
+		// resends once per time slice in case of loss
+		if ((int32_t)(net->frame - net->remote) >= (int)net->win) {
+			struct pollfd pfd;
+			if (new_time - last_time >= sleep_delay) {
+				net_send(net, 0);
+				net->stalls++;
+				last_time = new_time;
+			}
+			pfd.fd = net->fd; pfd.events = POLLIN;
+			poll(&pfd, 1, (sleep_delay + 999) / 1000);
+			continue;
+		}
+
+		net_step(rom, net, keys & 0x7f, frame_ticks);
+		net_recv(net);
+		net_sync(rom, net, frame_ticks);
+		net_send(net, 0);
+
+#if USE_SOUND
+		if (sys->snd)
+			sound_render(sys->snd, net->local.snd_num, net->local.snd_mode,
+					net->local.snd_starts, frame_ticks);
+#endif
+		sys_redraw(sys, net->local.s.mem);
+		if (sys->rec) rec_frame(sys->rec, net->local.s.mem);
+
+		new_time = get_time_usec();
+		delay = new_time - last_time;
+		if (delay > sleep_delay) { // late
+			last_time = new_time;
+		} else {
+			last_time += sleep_delay;
+			last_time -= sys_sleep(sys, sleep_delay - delay);
+		}
+	}
+	// the peer stops too, a few copies in case of loss
+	{
+		unsigned i, loss = net->loss;
+		net->loss = 0;
+		for (i = 0; i < 3; i++) net_send(net, 1);
+		net->loss = loss;
+	}
+	*s = net->local.s;
+}
+
+static void net_report(const netplay_t *net, unsigned sleep_delay) {
+	if (net->quit) fprintf(stderr, "netplay: the peer left\n");
+	else if (net->got && get_time_usec() - net->recv_time > NET_TIMEOUT)
+		fprintf(stderr, "netplay: the peer timed out\n");
+	fprintf(stderr, "netplay: %u frames, %u confirmed, %u stalls\n",
+			net->frame, net->conf, net->stalls);
+	if (net->rollbacks)
+		fprintf(stderr, "netplay: %u rollbacks, %.1f frames average, %u max, "
+				"%.1f us average, %u us max (frame is %u us)\n",
+				net->rollbacks, (double)net->rollback_frames / net->rollbacks,
+				net->rollback_max, (double)net->rollback_usec / net->rollbacks,
+				(unsigned)net->rollback_usec_max, sleep_delay);
+	if (net->desyncs)
+		fprintf(stderr, "netplay: DESYNC, %u frames differ, the first is %u\n",
+				net->desyncs, net->desync_frame);
+	close(net->fd);
+}
+#else
+void run_decomp(sysctx_t *user, cpu_state_t *cpu);
+#endif
+
+static void test_keys() {
+	char x;
+	while ((x | 32) != 'q')
+		if (read(0, &x, 1) == 1)
+			printf("0x%02x %u\n", x, x);
+}
+
+#if USE_GAMEPAD
+static void test_gamepad(int js_fd) {
 	struct js_event event;
 	if (js_fd >= 0)
 	for (;;) {
@@ -819,9 +3341,77 @@ static void test_gamepad(int js_fd) {
 }
 #endif
 
+#if FUZZ && !defined(DECOMPILED)
+// libFuzzer entry points ("make fuzz"), the input is:
+// FUZZ=1 - a save state, run on the ROM from $FUZZ_ROM (brickrom.bin)
+// FUZZ=2 - a ROM followed by the CPU state
+
+#ifndef FUZZ_TICKS
+#define FUZZ_TICKS 10000
+#endif
+
+// runs the variants side by side, aborts on a difference
+static void fuzz_run(const uint8_t *rom, cpu_state_t *s) {
+	static const cpu_backend_t run[] = { cpu_run_step, cpu_run, cpu_run_cov };
+	cpuctx_t c[3];
+	unsigned i, k;
+	char buf[64];
+
+	for (i = 0; i < 3; i++) cpu_init(&c[i], s, 32);
+	for (k = 0; k < FUZZ_TICKS; k += 100) {
+		for (i = 0; i < 3; i++) {
+			c[i].pp = c[i].ps = k / 100 & 15;
+			run[i](rom, &c[i], 100);
+		}
+		for (i = 1; i < 3; i++)
+			if (diff_state(&c[0], &c[i], buf, sizeof(buf))) {
+				fprintf(stderr, "variant %u differs at tick %u: %s\n", i, k, buf);
+				abort();
+			}
+		if (c[0].err) break;
+	}
+}
+
+#if FUZZ == 1
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	static uint8_t rom[0x1000];
+	static int rom_init;
+	cpu_state_t s;
+
+	if (!rom_init) {
+		const char *fn = getenv("FUZZ_ROM");
+		FILE *f = fopen(fn ? fn : "brickrom.bin", "rb");
+		if (!f) ERR_EXIT("fopen failed\n");
+		if (fread(rom, 1, sizeof(rom), f) != sizeof(rom))
+			ERR_EXIT("unexpected ROM size\n");
+		fclose(f);
+		rom_init = 1;
+	}
+	if (state_load(&s, data, size) == STATE_OK) fuzz_run(rom, &s);
+	return 0;
+}
+#else
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	uint8_t rom[0x1000] = { 0 };
+	cpu_state_t s;
+	size_t n = size < sizeof(rom) ? size : sizeof(rom);
+
+	memcpy(rom, data, n);
+	data += n; size -= n;
+	memset(&s, 0, sizeof(s));
+	memcpy(&s, data, size < sizeof(s) ? size : sizeof(s));
+	check_state(&s);
+	fuzz_run(rom, &s);
+	return 0;
+}
+#endif
+
+#else
 int main(int argc, char **argv) {
 	sysctx_t ctx;
-	const char *save_fn = NULL;
+	const char *save_fn = NULL, *shm_fn = NULL, *latency_fn = NULL;
+	const char *rec_fn = NULL;
+	static recorder_t rec;
 	FILE *f; unsigned n;
 #if USE_GAMEPAD
 	const char* js_fn = "/dev/input/js0";
@@ -829,24 +3419,172 @@ int main(int argc, char **argv) {
 #ifndef DECOMPILED
 	const char *rom_fn = "brickrom.bin";
 	uint8_t rom[0x1000];
+	uint64_t bench_ticks = 0;
+	const char *server_fn = NULL, *rollout_fn = NULL, *cov_fn = NULL;
+	const char *net_spec = NULL;
+	const char *record_fn = NULL, *replay_fn = NULL, *seek_str = NULL;
+	static replay_t replay_in, replay_out;
+	unsigned grid = 0;
+	static netplay_t net;
+#if USE_SOUND
+	const char *wav_fn = NULL, *sound_cmd = NULL;
+	sound_t snd;
 #endif
-	uint32_t hold_time = 50;
+	unsigned rollout_frames = 100, diff_seeds = 0, diff_jobs = 0, autoplay = 0;
+	int game = -1, game_speed = -1, game_level = -1, cached = 0;
+#if OP_STATS
+	const char *opstats_fn = NULL;
+#endif
+#if MEM_STATS
+	const char *memstats_fn = NULL;
+#endif
+#endif
+	uint32_t hold_time = 50, memmap_rate = 1, runahead = 0;
 	uint32_t sleep_ticks = 1000, sleep_delay = 1000;
 	uint32_t timer_inc = 32;
 	const char *progname = argv[0];
 	cpu_state_t cpu;
 
+#ifndef DECOMPILED
+	net.win = 32;
+#endif
 	while (argc > 1) {
 		if (!strcmp(argv[1], "--save")) {
 			if (argc <= 2) ERR_EXIT("bad option\n");
 			save_fn = argv[2];
 			if (!*save_fn) save_fn = NULL;
 			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--rec")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			rec_fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--latency")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			latency_fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--runahead")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			runahead = atoi(argv[2]);
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--shm")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			shm_fn = argv[2];
+			argc -= 2; argv += 2;
 #ifndef DECOMPILED
 		} else if (!strcmp(argv[1], "--rom")) {
 			if (argc <= 2) ERR_EXIT("bad option\n");
 			rom_fn = argv[2];
 			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--bench")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			bench_ticks = strtoull(argv[2], NULL, 0);
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--rollout")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			rollout_fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--frames")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			rollout_frames = atoi(argv[2]);
+			argc -= 2; argv += 2;
+#if USE_SOUND
+		} else if (!strcmp(argv[1], "--wav")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			wav_fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--sound")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			sound_cmd = argv[2];
+			argc -= 2; argv += 2;
+#endif
+		} else if (!strcmp(argv[1], "--game")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			game = atoi(argv[2]);
+			if (game < 0 || game > 254) ERR_EXIT("bad game number\n");
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--speed")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			game_speed = atoi(argv[2]);
+			if (game_speed < 0 || game_speed > 19) ERR_EXIT("bad speed\n");
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--level")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			game_level = atoi(argv[2]);
+			if (game_level < 0 || game_level > 19) ERR_EXIT("bad level\n");
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--record")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			record_fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--replay")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			replay_fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--seek")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			seek_str = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--grid")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			grid = atoi(argv[2]);
+			if (grid - 1 >= GRID_MAX) ERR_EXIT("bad grid size\n");
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--net")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			net_spec = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--rollback")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			net.win = atoi(argv[2]);
+			if (net.win - 1 >= NET_WIN_MAX) ERR_EXIT("bad rollback window\n");
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--netloss")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			net.loss = atoi(argv[2]);
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--autoplay")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			autoplay = atoi(argv[2]);
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--difftest")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			diff_seeds = atoi(argv[2]);
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "-j")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			diff_jobs = atoi(argv[2]);
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--cov")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			cov_fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--server")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			server_fn = argv[2];
+			argc -= 2; argv += 2;
+#if USE_DEBUG
+		} else if (!strcmp(argv[1], "--break")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			if (dbg_set_break(argv[2])) ERR_EXIT("bad breakpoint\n");
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--watch")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			if (dbg_set_watch(argv[2])) ERR_EXIT("bad watchpoint\n");
+			argc -= 2; argv += 2;
+#endif
+#if MEM_STATS
+		} else if (!strcmp(argv[1], "--memstats")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			memstats_fn = argv[2];
+			mem_on = 1;
+			argc -= 2; argv += 2;
+#endif
+#if OP_STATS
+		} else if (!strcmp(argv[1], "--opstats")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			opstats_fn = argv[2];
+			argc -= 2; argv += 2;
+#endif
 #endif
 #if USE_GAMEPAD
 		} else if (!strcmp(argv[1], "--js")) {
@@ -863,27 +3601,73 @@ int main(int argc, char **argv) {
 #ifndef DECOMPILED
 "  --rom file        To specify the ROM file name\n"
 "                      (default is \"%s\")\n"
+"  --bench n         Run N ticks without display and print the speed\n"
+#if USE_SOUND
+"  --wav file        Write the sound to a WAV file\n"
+"  --sound command   Pipe the sound to a command as raw PCM\n"
+"                      (S16_LE, mono, " STR(SOUND_RATE) " Hz)\n"
+#endif
+"  --cov file        Add executed ROM addresses and jumps to the coverage map\n"
+"  --game n          Start the game N presses away from the first one,\n"
+"                      the state is cached in <rom>.<hash>.snap\n"
+"  --speed n         Choose the speed before starting the game\n"
+"  --level n         Choose the level before starting the game\n"
+"  --server path     Host a console for each client of the UNIX socket\n"
+"  --rollout file    Run the saved state with each line of the file\n"
+"                      as input script and print score and game over flag\n"
+"  --frames n        Number of time slices for each rollout or seed\n"
+"                      (default is %d)\n"
+"  --record file     Record the keys with keyframes to a seekable replay\n"
+"  --replay file     Play the replay, the keys work again at its end\n"
+"  --seek time       Start the replay at the time (seconds or mm:ss)\n"
+"  --grid n          Run N consoles (up to " STR(GRID_MAX) ") side by side, the keys go\n"
+"                      to all of them or to the one chosen with , and .\n"
+"  --net port:host:port  Play against the peer at the address (UDP),\n"
+"                      the first port is the local one\n"
+"  --rollback n      Max time slices to run ahead of the peer (default is %d)\n"
+"  --netloss n       Drop N percent of the sent packets, for testing\n"
+"  --autoplay n      Play N pieces of Tetris without display, starting\n"
+"                      from the saved state (or --game)\n"
+"  --difftest n      Run N seeds with random input on every interpreter\n"
+"                      variant and compare them with the reference\n"
+"  -j n              Number of threads for --difftest (default is all cores)\n"
+#if USE_DEBUG
+"  --break spec      Set a breakpoint (\"1a3\", \"1a3 a=5\", \"1a3 [8f]=3\")\n"
+"  --watch spec      Set a watchpoint (\"8f\", \"8f rw\", \"8f c\", \"8f =3\")\n"
+#endif
+#if OP_STATS
+"  --opstats file    Save opcode pair and triple frequencies\n"
+#endif
+#if MEM_STATS
+"  --memstats file   Count memory reads and writes, save them as CSV\n"
+"                      and show them on the memory map (Tab)\n"
+#endif
 #endif
 #if USE_GAMEPAD
 "  --js device       To specify gamepad device\n"
 "                      (default is \"%s\")\n"
 #endif
 "  --save file       To specify the file for cpu state\n"
+"  --shm name        Publish the display state to POSIX shared memory\n"
+"  --latency file    Save the input latency histogram on exit\n"
+"  --rec file        Record the display to asciicast or GIF (*.gif)\n"
+"  --runahead n      Display the state N time slices ahead\n"
 "  -k n              Holds a key for N ms after pressing (default is %d)\n"
 "  -t n              Stops at every N tick to redraw, sleep and check keys\n"
 "                      (default is %d)\n"
 "  -d n              Max sleep time in microseconds (default is %d)\n"
 "  -i n              Increment timer every N ticks (default is %d)\n"
+"  -m n              Redraw memory map every N time slices (default is %d)\n"
 "\n", progname,
 #ifndef DECOMPILED
-		rom_fn,
+		rom_fn, rollout_frames, net.win,
 #endif
 #if USE_GAMEPAD
 		js_fn,
 #endif
 		hold_time,
 		sleep_ticks,
-		sleep_delay, timer_inc);
+		sleep_delay, timer_inc, memmap_rate);
 			return 1;
 		} else if (!strcmp(argv[1], "-k")) {
 			if (argc <= 2) ERR_EXIT("bad option\n");
@@ -897,6 +3681,10 @@ int main(int argc, char **argv) {
 			if (argc <= 2) ERR_EXIT("bad option\n");
 			sleep_delay = atoi(argv[2]);
 			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "-m")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			memmap_rate = atoi(argv[2]);
+			argc -= 2; argv += 2;
 		} else if (!strcmp(argv[1], "-i")) {
 			if (argc <= 2) ERR_EXIT("bad option\n");
 			timer_inc = atoi(argv[2]);
@@ -913,44 +3701,149 @@ int main(int argc, char **argv) {
 	n = fread(rom, 1, sizeof(rom), f);
 	fclose(f);
 	if (n != sizeof(rom)) ERR_EXIT("unexpected ROM size\n");
+	if (cov_fn) cov_load(cov_fn);
+#if MEM_STATS
+	// cpu_run_mem() doesn't record coverage
+	if (cov_fn && memstats_fn) ERR_EXIT("--cov and --memstats can't be used together\n");
+#endif
 #endif
 
 	memset(&cpu, 0, sizeof(cpu));
 	if (save_fn) {
 		f = fopen(save_fn, "rb");
 		if (f) {
-			n = fread(&cpu, 1, sizeof(cpu), f);
+			uint8_t buf[sizeof(cpu) + 1];
+			n = fread(buf, 1, sizeof(buf), f);
 			fclose(f);
-			if (n != sizeof(cpu)) ERR_EXIT("unexpected save size\n");
+			switch (state_load(&cpu, buf, n)) {
+			case STATE_ERR_SIZE: ERR_EXIT("unexpected save size\n");
+			case STATE_ERR_CORRUPT: ERR_EXIT("save state is corrupted\n");
+			}
+		}
+	}
+#ifndef DECOMPILED
+	// replaces the saved state, but the save file is still written on exit
+	if (game >= 0 || game_speed >= 0 || game_level >= 0) {
+		snap_cache(rom, rom_fn, game, game_speed, game_level, timer_inc, &cpu);
+		cached = 1;
+	}
+	if (replay_fn) {
+		double sec = 0;
+		if (seek_str) {
+			char *end;
+			sec = strtod(seek_str, &end);
+			if (*end == ':') sec = sec * 60 + strtod(end + 1, &end);
+			if (*end || sec < 0) ERR_EXIT("bad seek time\n");
 		}
-		if (check_state(&cpu)) ERR_EXIT("save state is corrupted\n");
+		replay_open(&replay_in, replay_fn, rom);
+		replay_seek(rom, &replay_in, sec * 1e6 / replay_in.hdr.frame_usec *
+				replay_in.hdr.frame_ticks);
+		cpu = replay_in.c.s;
 	}
+#endif
 
-	sys_init(&ctx);
+	memset(&ctx, 0, sizeof(ctx));
 	ctx.hold_time = hold_time;
 	ctx.sleep_ticks = sleep_ticks;
 	ctx.sleep_delay = sleep_delay;
 	ctx.timer_inc = timer_inc;
-
+	ctx.memmap_rate = memmap_rate;
+	ctx.runahead = runahead;
 #if USE_GAMEPAD
 	ctx.js_fd = -1;
-	if (js_fn) {
-		ctx.js_fd = open(js_fn, O_RDONLY);
-		if (ctx.js_fd >= 0) sys_gamepad_init(&ctx);
-		//test_gamepad(ctx.js_fd);
+	ctx.js_fn = js_fn;
+#endif
+#if USE_SOUND && !defined(DECOMPILED)
+	if (wav_fn || sound_cmd) {
+		sound_init(&snd, wav_fn, sound_cmd);
+		ctx.snd = &snd;
+	}
+#endif
+
+#ifndef DECOMPILED
+	if (bench_ticks) {
+		run_bench(rom, &cpu, &ctx, bench_ticks);
+		goto save;
+	}
+	if (autoplay) {
+		run_autoplay(rom, &cpu, autoplay, sleep_ticks, timer_inc);
+		goto save;
+	}
+	if (diff_seeds) {
+		// the saved state or random ones
+		return run_difftest(rom, save_fn || cached ? &cpu : NULL, diff_seeds, diff_jobs,
+				rollout_frames, sleep_ticks, timer_inc) != 0;
+	}
+	if (rollout_fn) {
+		run_rollouts(rom, &cpu, rollout_fn, rollout_frames, sleep_ticks, timer_inc);
+		if (cov_fn) cov_save(cov_fn);
+		return 0;
+	}
+	if (server_fn) {
+		run_server(rom, server_fn, &cpu, sleep_ticks, sleep_delay, timer_inc);
+		if (cov_fn) cov_save(cov_fn);
+		return 0;
 	}
 #endif
 
+#ifndef DECOMPILED
+	if (net_spec) net_open(&net, net_spec);
+	if (replay_fn) ctx.replay_in = &replay_in;
+	if (record_fn && (net_spec || grid)) ERR_EXIT("--record works only in the normal mode\n");
+	if (record_fn) {
+		// from the replayed state, if any
+		cpuctx_t c;
+		if (replay_fn) c = replay_in.c;
+		else cpu_init(&c, &cpu, timer_inc);
+		replay_create(&replay_out, record_fn, rom, &c, sleep_ticks, sleep_delay);
+		ctx.replay_out = &replay_out;
+	}
+#endif
+	sys_init(&ctx);
+	if (shm_fn) sys_shm_init(&ctx, shm_fn);
+	if (rec_fn) rec_init(ctx.rec = &rec, rec_fn);
+
 	//test_keys();
 #ifndef DECOMPILED
-	run_game(rom, &ctx, &cpu);
+	if (net_spec) run_netplay(rom, &ctx, &cpu, &net);
+	else if (grid) run_grid(rom, &ctx, &cpu, grid);
+	else run_game(rom, &ctx, &cpu);
 #else
 	ctx.timer_inc = timer_inc * sleep_ticks >> 8;
 	ctx.last_time = get_time_usec();	
 	ctx.randseed = ctx.last_time;
 	run_decomp(&ctx, &cpu);
 #endif
+	sys_close(&ctx);
+	if (ctx.rec) rec_close(ctx.rec);
+	if (latency_fn) sys_latency_dump(&ctx, latency_fn);
+	if (ctx.runahead && ctx.run_usec)
+		fprintf(stderr, "run-ahead %u: %.3fs extra emulation time (+%.1f%%)\n",
+				ctx.runahead, ctx.runahead_usec * 1e-6,
+				100.0 * ctx.runahead_usec / ctx.run_usec);
+#ifndef DECOMPILED
+	if (net_spec) net_report(&net, sleep_delay);
+	if (replay_in.diverged)
+		fprintf(stderr, "replay: diverged at tick %llu, %u keyframes differ\n",
+				(unsigned long long)replay_in.diverged_tick, replay_in.diverged);
+	if (grid && ctx.grid_usec)
+		fprintf(stderr, "grid: %.1f KB/s terminal output\n",
+				ctx.grid_bytes * 1000.0 / ctx.grid_usec);
+#endif
 
+#ifndef DECOMPILED
+save:
+#if USE_SOUND
+	if (ctx.snd) sound_close(ctx.snd);
+#endif
+#if OP_STATS
+	if (opstats_fn) op_stats_dump(opstats_fn);
+#endif
+#if MEM_STATS
+	if (memstats_fn) mem_stats_dump(memstats_fn);
+#endif
+	if (cov_fn) cov_save(cov_fn);
+#endif
 	if (save_fn) {
 		f = fopen(save_fn, "wb");
 		if (f) {
@@ -958,9 +3851,8 @@ int main(int argc, char **argv) {
 			fclose(f);
 		}
 	}
-
-	sys_close(&ctx);
 }
+#endif // FUZZ
 
 #ifdef DECOMPILED
 
@@ -973,6 +3865,7 @@ static void timer_handler(sysctx_t *sys, cpu_state_t *cpu) {
 		sys->last_time = last_time + sleep_delay;
 		sys->tmr_frac += sys->timer_inc;
 		sys_redraw(sys, cpu->mem);
+		if (sys->rec) rec_frame(sys->rec, cpu->mem);
 		sys_events(sys);
 	}
 }
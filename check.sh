@@ -0,0 +1,111 @@
+#!/bin/sh
+# Regression checks on small synthetic ROMs, run by "make check".
+# usage: check.sh [binary]
+
+BIN=${1:-./brickgame}
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+FAIL=0
+
+ok() { echo "ok: $1"; }
+fail() { echo "FAIL: $1"; FAIL=1; }
+
+# mkrom file hex... - the bytes at address 0, the rest is zeros
+mkrom() {
+	f=$1; shift
+	: > "$f"
+	for b in "$@"; do printf "\\$(printf %o "0x$b")" >> "$f"; done
+	n=$(wc -c < "$f")
+	head -c $((4096 - n)) /dev/zero >> "$f"
+}
+
+# INC [0xb0] in a loop, the display changes all the time
+mkrom "$TMP/inc.rom" 50 0b 0c e0 02
+
+# server: consoles run at the -d rate (100 slices per second)
+if command -v python3 >/dev/null; then
+	"$BIN" --rom "$TMP/inc.rom" --server "$TMP/sock" -d 10000 &
+	pid=$!
+	n=$(python3 - "$TMP/sock" <<'EOF'
+import socket, sys, time
+for i in range(50):
+	try:
+		s = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+		s.connect(sys.argv[1]); break
+	except OSError: time.sleep(0.1)
+n = 0; end = time.time() + 1
+s.settimeout(0.1)
+while time.time() < end:
+	try: n += s.recv(4096)[:1] == b'F'
+	except socket.timeout: pass
+print(n)
+EOF
+)
+	kill $pid; wait $pid
+	if [ "$n" -ge 50 ] && [ "$n" -le 150 ]; then ok "server rate ($n frames/s)"
+	else fail "server rate ($n frames/s, expected 100)"; fi
+else
+	echo "skip: server rate (no python3)"
+fi
+
+# the fused MOV R1R0, imm8; READ R4A; MOV [R1R0], A all over the ROM,
+# at every offset and slice boundary
+: > "$TMP/read.rom"
+i=0
+while [ $i -lt 512 ]; do
+	printf '\123\012\114\005\134\001\114\005' >> "$TMP/read.rom"
+	i=$((i + 1))
+done
+if "$BIN" --rom "$TMP/read.rom" --difftest 200 --frames 50 2> /dev/null; then ok "fused triple"
+else fail "fused triple"; fi
+
+# the menu navigation boots with the timer running: the ROM sets [0] to 1
+# on the first timer overflow, the cache has a record for each -i
+mkrom "$TMP/tmr.rom" 38 50 00 d0 07 e0 03 71 05 e0 03
+"$BIN" --rom "$TMP/tmr.rom" --game 0 --bench 1 --save "$TMP/tmr.sav" > /dev/null
+a=$(od -An -tu1 -N1 "$TMP/tmr.sav" | tr -d ' ')
+size1=$(cat "$TMP/tmr.rom".*.snap | wc -c)
+"$BIN" --rom "$TMP/tmr.rom" --game 0 --bench 1 -i 7 > /dev/null
+"$BIN" --rom "$TMP/tmr.rom" --game 0 --bench 1 -i 7 > /dev/null
+size2=$(cat "$TMP/tmr.rom".*.snap | wc -c)
+if [ "$a" = 1 ]; then ok "snapshot timer"; else fail "snapshot timer ([0] = $a)"; fi
+if [ "$size1" -gt 0 ] && [ "$size2" = $((size1 * 2)) ]; then ok "snapshot cache key"
+else fail "snapshot cache key ($size1, $size2 bytes)"; fi
+
+# replay: a recording with a corrupted index is rejected before seeking
+if command -v python3 >/dev/null; then
+	res=$(python3 - "$BIN" "$TMP" <<'EOF'
+import os, pty, select, struct, subprocess, sys, time
+bin, tmp = sys.argv[1:]
+# runs in a terminal for sec seconds, then presses Escape
+def term(sec, *args):
+	pid, fd = pty.fork()
+	if not pid: os.execv(bin, [bin, "--rom", tmp + "/inc.rom"] + list(args))
+	out, end = b"", time.time() + sec
+	while True:
+		if end and time.time() > end: os.write(fd, b"\x1b"); end = 0
+		if select.select([fd], [], [], 0.05)[0]:
+			try: out += os.read(fd, 65536)
+			except OSError: break
+	os.waitpid(pid, 0)
+	return out
+term(0.5, "--record", tmp + "/r.bgr")
+d = bytearray(open(tmp + "/r.bgr", "rb").read())
+index_off = struct.unpack_from("=Q", d, 40)[0]
+ok = b"replay: keyframe" in term(0.5, "--replay", tmp + "/r.bgr", "--seek", "0.2")
+# the index offset, then the first keyframe offset in the index
+for pos, val in (40, index_off + 4), (index_off + 8, 60), (index_off + 8, 0):
+	t = bytearray(d); struct.pack_into("=Q", t, pos, val)
+	open(tmp + "/bad.bgr", "wb").write(t)
+	p = subprocess.run([bin, "--rom", tmp + "/inc.rom", "--replay", tmp + "/bad.bgr"],
+			stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, timeout=5)
+	ok = ok and p.returncode != 0 and b"bad replay index" in p.stderr
+print(int(ok))
+EOF
+)
+	if [ "$res" = 1 ]; then ok "replay index"; else fail "replay index"; fi
+else
+	echo "skip: replay index (no python3)"
+fi
+
+exit $FAIL
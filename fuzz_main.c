@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2023, Ilya Kurdyukov
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY
+ * DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+// runs a fuzz target on the given files, for compilers without libFuzzer
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int main(int argc, char **argv) {
+	int i;
+	for (i = 1; i < argc; i++) {
+		FILE *f = fopen(argv[i], "rb");
+		uint8_t *buf; long n;
+		if (!f) { fprintf(stderr, "fopen failed: %s\n", argv[i]); return 1; }
+		fseek(f, 0, SEEK_END);
+		n = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		buf = malloc(n ? n : 1);
+		if (!buf || fread(buf, 1, n, f) != (size_t)n) {
+			fprintf(stderr, "read failed: %s\n", argv[i]); return 1;
+		}
+		fclose(f);
+		LLVMFuzzerTestOneInput(buf, n);
+		free(buf);
+	}
+	return 0;
+}
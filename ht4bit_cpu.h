@@ -0,0 +1,441 @@
+/*
+ * Copyright (c) 2023, Ilya Kurdyukov
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY
+ * DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/*
+ * The interpreter loop, brickgame.c includes it for each variant:
+ * CPU_RUN - the function name,
+ * CPU_DEBUG - checks breakpoints and watchpoints (see dbg_t),
+ * CPU_COV - records executed addresses and jumps to cov_map[],
+ * CPU_MEM - counts reads and writes of each nibble in mem_reads[]
+ *   and mem_writes[] (optional, the others leave it undefined).
+ * The file includes itself to make a loop with the timer (CPU_TIMER = 1)
+ * and without it, so the loop doesn't check the timer_en flag.
+ */
+
+#ifndef CPU_TIMER
+// fused opcodes would hide the second address from the checks
+#define FUSE_ON (CPU_FUSE && !CPU_DEBUG)
+
+#if CPU_COV
+#define COV_EXEC_AT(p) (cov_map[p] |= COV_EXEC)
+#define COV_JUMP_AT(p, taken) (cov_map[p] |= (taken) ? COV_TAKEN : COV_NOT_TAKEN)
+#else
+#define COV_EXEC_AT(p) 0
+#define COV_JUMP_AT(p, taken) (void)0
+#endif
+
+// updates the memory hash on every write (see cpu_hash)
+#if CPU_HASH
+#define MEM_HASH(x, v) (c->mem_hash ^= ZOBRIST_MEM(x, s->mem[x]) ^ ZOBRIST_MEM(x, v))
+#else
+#define MEM_HASH(x, v) (void)0
+#endif
+
+#if CPU_DEBUG
+#define MEM_RD(x) (dbg.watch[x] ? dbg_access(x, -1, s->mem[x]) : s->mem[x])
+#define MEM_WR(x, v) do { unsigned v_ = (v); \
+	if (dbg.watch[x]) dbg_access(x, v_, s->mem[x]); \
+	MEM_HASH(x, v_); s->mem[x] = v_; \
+} while (0)
+#elif CPU_MEM
+#define MEM_RD(x) (mem_reads[x]++, s->mem[x])
+#define MEM_WR(x, v) do { unsigned x_ = (x), v_ = (v); \
+	mem_writes[x_]++; MEM_HASH(x_, v_); s->mem[x_] = v_; \
+} while (0)
+#elif CPU_HASH
+#define MEM_RD(x) s->mem[x]
+#define MEM_WR(x, v) do { unsigned x_ = (x), v_ = (v); \
+	MEM_HASH(x_, v_); s->mem[x_] = v_; \
+} while (0)
+#else
+#define MEM_RD(x) s->mem[x]
+#define MEM_WR(x, v) (s->mem[x] = (v))
+#endif
+
+// the timer is a 24-bit counter (tmr:tmr_frac), tf is set on overflow
+#define TIMER_ADD(k) { \
+	uint64_t t = (uint64_t)timer_inc * (k) + (s->tmr << 16 | tmr_frac); \
+	if (t >> 24) s->tf = 1; \
+	s->tmr = t >> 16; tmr_frac = t & 0xffff; \
+}
+// adds the ticks passed since the last sync, before the timer is accessed
+#define TIMER_SYNC if (CPU_TIMER) { TIMER_ADD(sync - ticks) sync = ticks; }
+// returns after this instruction to find the next timer interrupt
+#define INT_CHECK if (INT_TIMER) { \
+	left += ticks - 1; sync -= ticks - 1; ticks = 1; }
+
+#define CPU_CAT1(a, b) a##b
+#define CPU_CAT(a, b) CPU_CAT1(a, b)
+
+#define CPU_TIMER 0
+#include "ht4bit_cpu.h"
+#undef CPU_TIMER
+#define CPU_TIMER 1
+#include "ht4bit_cpu.h"
+#undef CPU_TIMER
+
+// returns the number of ticks left if stopped by the debugger
+// or by an error (c->err), the error stays set until cleared
+static uint32_t CPU_RUN(const uint8_t *rom, cpuctx_t *c, uint32_t ticks) {
+	// the loops return early when TIMER ON/OFF switches the mode
+	while (ticks && !c->err) {
+#if INT_TIMER
+		if (c->ie && c->s.tf) cpu_interrupt(c);
+#endif
+		if (c->s.timer_en) {
+#if INT_TIMER
+			// stops at the overflow to take the interrupt
+			uint32_t n = ticks, k;
+			if (c->ie && (k = cpu_timer_left(c)) < n) n = k;
+			ticks -= n - CPU_CAT(CPU_RUN, 1)(rom, c, n);
+#else
+			ticks = CPU_CAT(CPU_RUN, 1)(rom, c, ticks);
+#endif
+		} else ticks = CPU_CAT(CPU_RUN, 0)(rom, c, ticks);
+#if CPU_DEBUG
+		if (dbg.hit) break;
+#endif
+	}
+	return ticks;
+}
+
+#undef TIMER_ADD
+#undef TIMER_SYNC
+#undef INT_CHECK
+#undef CPU_CAT1
+#undef CPU_CAT
+#undef FUSE_ON
+#undef COV_EXEC_AT
+#undef COV_JUMP_AT
+#undef MEM_RD
+#undef MEM_WR
+#undef MEM_HASH
+#undef R1R0
+#undef R3R2
+#undef TRACE
+#undef TRACE_JUMP
+#undef CASE8
+
+#else
+static uint32_t CPU_CAT(CPU_RUN, CPU_TIMER)(const uint8_t *rom,
+		cpuctx_t *c, uint32_t ticks) {
+	cpu_state_t *s = &c->s;
+	unsigned pc = s->pc;
+	unsigned a = s->a, cf = s->cf;
+	uint32_t tmr_frac = c->tmr_frac, timer_inc = c->timer_inc;
+	uint32_t left = 0, sync = ticks;
+	c->tickcount += ticks;
+#if FUSE_ON
+	static const uint8_t jnz_rn[5] = { 0xa0, 0xa8, 1, 1, 0xd8 };
+#endif
+#if OP_STATS
+	static unsigned prev_ops;
+#endif
+
+	while (ticks) {
+		unsigned x, op, n = 1;
+#if CPU_COV
+		unsigned pc0 = pc;
+		COV_EXEC_AT(pc);
+#endif
+		op = rom[pc];
+#define R1R0 s->r[1] << 4 | s->r[0]
+#define R3R2 s->r[3] << 4 | s->r[2]
+
+#if CPU_DEBUG
+		// stop before the instruction, but not the one we resume from
+		if (dbg.bp[pc] && !dbg.resume && dbg_break(s, pc, a, cf)) break;
+		dbg.resume = 0;
+#endif
+
+#if CPU_TRACE
+#define TRACE(...) fprintf(stderr, "  " __VA_ARGS__)
+		fprintf(stderr, "%03x: o=%02x,r=%x:%02x:%02x:%x,c%u",
+				pc, op, a, R1R0, R3R2, s->r[4], cf);
+#else
+#define TRACE(...) (void)0
+#endif
+
+#if OP_STATS
+		prev_ops = (prev_ops << 8 | OP_CLASS(op)) & 0xffffff;
+		op_stats_add(prev_ops);
+#endif
+
+// executes the next opcode in the same dispatch if it matches
+#if FUSE_ON
+#define FUSE(cond) \
+	if (ticks > 1 && (x = rom[(pc + 1) & 0xfff], cond) && (pc = (pc + 1) & 0xfff, COV_EXEC_AT(pc), n = 2))
+#else
+#define FUSE(cond) if (0)
+#endif
+
+	switch (op) {
+
+	case 0x00: /* RR A */
+		cf = a & 1; a = (a << 4 | a) >> 1 & 15; TRACE("a=%x,c=%u", a, cf); break;
+	case 0x01: /* RL A */
+		cf = a >> 3; a = (a << 4 | a) >> 3 & 15; TRACE("a=%x,c=%u", a, cf); break;
+	case 0x02: /* RRC A */
+		a = cf << 4 | a; cf = a & 1; a >>= 1; TRACE("a=%x,c=%u", a, cf); break;
+	case 0x03: /* RLC A */
+		a = a << 1 | cf; cf = a >> 4; a &= 15; TRACE("a=%x,c=%u", a, cf); break;
+
+	case 0x04: // MOV A, [R1R0]
+	case 0x06: // MOV A, [R3R2]
+		x = op & 2; x = s->r[x + 1] << 4 | s->r[x]; a = MEM_RD(x); TRACE("a=%x", a); break;
+	case 0x05: // MOV [R1R0], A
+	case 0x07: // MOV [R3R2], A
+		x = op & 2; x = s->r[x + 1] << 4 | s->r[x]; MEM_WR(x, a); TRACE("m[%02x]=%x", x, a); break;
+
+	case 0x08: /* ADC A, [R1R0] */
+	case 0x09: /* ADD A, [R1R0] */
+		cf &= ~op;
+		a += MEM_RD(R1R0) + cf; cf = a >> 4; a &= 15;
+		TRACE("a=%x", a);
+		break;
+
+	case 0x0a: /* SBC A, [R1R0] */
+	case 0x0b: /* SUB A, [R1R0] */
+		cf |= op & 1;
+		a += 15 - MEM_RD(R1R0) + cf; cf = a >> 4; a &= 15;
+		TRACE("a=%x", a);
+		break;
+
+	case 0x0c: // INC [R1R0]
+	case 0x0d: // DEC [R1R0]
+	case 0x0e: // INC [R3R2]
+	case 0x0f: // DEC [R3R2]
+		x = op & 2; x = s->r[x + 1] << 4 | s->r[x];
+		MEM_WR(x, (MEM_RD(x) + (op & 1 ? -1 : 1)) & 15);
+		TRACE("m[%02x]=%x", x, s->mem[x]);
+		break;
+
+	// followed by JNZ Rn, imm11 (only R0, R1, R4)
+#define JNZ_RN \
+	FUSE((x & 0xf8) == jnz_rn[op >> 1 & 7]) { \
+		x = (pc & 0x800) | (x & 7) << 8 | rom[(pc + 1) & 0xfff]; \
+		COV_JUMP_AT(pc, s->r[op >> 1 & 7]); \
+		pc++; if (s->r[op >> 1 & 7]) pc = x - 1; \
+	}
+
+	case 0x10: case 0x12: // INC Rn
+	case 0x14: case 0x16: case 0x18:
+		x = op >> 1 & 7; s->r[x] = (s->r[x] + 1) & 15; TRACE("r%u=%x", x, s->r[x]);
+		JNZ_RN break;
+
+	case 0x11: case 0x13: // DEC Rn
+	case 0x15: case 0x17: case 0x19:
+		x = op >> 1 & 7; s->r[x] = (s->r[x] - 1) & 15; TRACE("r%u=%x", x, s->r[x]);
+		JNZ_RN break;
+#undef JNZ_RN
+
+	case 0x1a: /* AND A, [R1R0] */ a &= MEM_RD(R1R0); TRACE("a=%x", a); break;
+	case 0x1b: /* XOR A, [R1R0] */ a ^= MEM_RD(R1R0); TRACE("a=%x", a); break;
+	case 0x1c: /* OR A, [R1R0] */ a |= MEM_RD(R1R0); TRACE("a=%x", a); break;
+	case 0x1d: /* AND [R1R0], A */ x = R1R0; MEM_WR(x, MEM_RD(x) & a); TRACE("m[%02x]=%x", x, s->mem[x]); break;
+	case 0x1e: /* XOR [R1R0], A */ x = R1R0; MEM_WR(x, MEM_RD(x) ^ a); TRACE("m[%02x]=%x", x, s->mem[x]); break;
+	case 0x1f: /* OR [R1R0], A */ x = R1R0; MEM_WR(x, MEM_RD(x) | a); TRACE("m[%02x]=%x", x, s->mem[x]); break;
+
+	case 0x20: case 0x22: // MOV Rn, A
+	case 0x24: case 0x26: case 0x28:
+		s->r[op >> 1 & 7] = a; TRACE("r%u=%x", op >> 1 & 7, a); break;
+
+	case 0x21: case 0x23: // MOV A, Rn
+	case 0x25: case 0x27: case 0x29:
+		a = s->r[op >> 1 & 7]; TRACE("a=%x", a); break;
+
+	case 0x2a: /* CLC */ cf = 0; TRACE("c=%x", cf); break;
+	case 0x2b: /* STC */ cf = 1; TRACE("c=%x", cf); break;
+	case 0x2c: /* EI */ c->ie = 1; TRACE("i=%x", 1); INT_CHECK break;
+	case 0x2d: /* DI */ c->ie = 0; TRACE("i=%x", 0); break;
+	case 0x2e: /* RET */
+		pc = s->stack; TRACE("pc=%03x", pc); pc--; break;
+	case 0x2f: /* RETI */
+		pc = s->stack; cf = pc >> 12; TRACE("pc=%03x,c=%u", pc, cf);
+		if (INT_TIMER) c->ie = 1;
+		INT_CHECK pc--; break;
+
+	case 0x30: /* OUT PA, A */ c->pa = a; TRACE("pa=%x", a); break;
+	case 0x31: /* INC A */ a = (a + 1) & 15; TRACE("a=%x", a); break;
+	case 0x32: /* IN A, PM */ a = c->pm; TRACE("a=%x", a); break;
+	case 0x33: /* IN A, PS */ a = c->ps; TRACE("a=%x", a); break;
+	case 0x34: /* IN A, PP */ a = c->pp; TRACE("a=%x", a); break;
+	case 0x35: /* unknown */ break;
+	case 0x36: /* DAA */
+		if (a >= 10 || cf) a = (a + 6) & 15, cf = 1, TRACE("a=%x,c=%u", a, cf);
+		break;
+	case 0x37: /* HALT */
+		TRACE("halt"); break;
+	case 0x38: /* TIMER ON */
+		s->timer_en = 1; TRACE("timer on");
+#if !CPU_TIMER
+		// counts this instruction and returns to switch the loop
+		TIMER_ADD(1)
+		left = ticks - 1; ticks = 1;
+#endif
+		break;
+	case 0x39: /* TIMER OFF */
+		TIMER_SYNC s->timer_en = 0; TRACE("timer off");
+#if CPU_TIMER
+		// doesn't count this instruction
+		timer_inc = 0;
+		left = ticks - 1; ticks = 1;
+#endif
+		break;
+	case 0x3a: /* MOV A, TMRL */
+		TIMER_SYNC a = s->tmr & 15; TRACE("a=%x", a); break;
+	case 0x3b: /* MOV A, TMRH */
+		TIMER_SYNC a = s->tmr >> 4; TRACE("a=%x", a); break;
+	case 0x3c: /* MOV TMRL, A */
+		TIMER_SYNC s->tmr = (s->tmr & 0xf0) | a; TRACE("tmrl=%x", a); INT_CHECK break;
+	case 0x3d: /* MOV TMRH, A */
+		TIMER_SYNC s->tmr = a << 4 | (s->tmr & 15); TRACE("tmrh=%x", a); INT_CHECK break;
+	case 0x3e: /* NOP */
+		TRACE("nop"); break;
+	case 0x3f: /* DEC A */ a = (a - 1) & 15; TRACE("a=%x", a); break;
+
+	case 0x40: // ADD A, imm4
+		a += rom[++pc & 0xfff] & 15;
+		cf = a >> 4; a &= 15; TRACE("a=%x", a); break;
+	case 0x41: // SUB A, imm4
+		a += 16 - (rom[++pc & 0xfff] & 15);
+		cf = a >> 4; a &= 15; TRACE("a=%x", a); break;
+	case 0x42: // AND A, imm4
+		a &= rom[++pc & 0xfff]; TRACE("a=%x", a); break;
+	case 0x43: // XOR A, imm4
+		a ^= rom[++pc & 0xfff] & 15; TRACE("a=%x", a); break;
+	case 0x44: // OR A, imm4
+		a |= rom[++pc & 0xfff] & 15; TRACE("a=%x", a); break;
+	case 0x45: // SOUND imm4
+		x = rom[++pc & 0xfff] & 15; TRACE("sound %x", x);
+		c->snd_num = x; break;
+	case 0x46: // MOV R4, imm4
+		s->r[4] = rom[++pc & 0xfff] & 15; TRACE("r4=%x", s->r[4]); break;
+	case 0x47: // TIMER imm8
+		TIMER_SYNC s->tmr = rom[++pc & 0xfff]; TRACE("tmr=%02x", s->tmr); INT_CHECK break;
+	case 0x48: /* SOUND ONE */
+		c->snd_mode = 1; c->snd_starts++; TRACE("sound one"); break;
+	case 0x49: /* SOUND LOOP */
+		c->snd_mode = 2; c->snd_starts++; TRACE("sound loop"); break;
+	case 0x4a: /* SOUND OFF */
+		c->snd_mode = 0; TRACE("sound off"); break;
+	case 0x4b: /* SOUND A */
+		c->snd_num = a; TRACE("sound a"); break;
+
+	case 0x4c: /* READ R4A */
+		a = rom[(pc & 0xf00) | a << 4 | MEM_RD(R1R0)];
+		TRACE("r4:a=%02x", a);
+		s->r[4] = a >> 4; a &= 15;
+		// followed by MOV [R1R0], A
+		FUSE(x == 0x05) MEM_WR(R1R0, a);
+		break;
+	case 0x4d: /* READF R4A */
+		a = rom[0xf00 | a << 4 | MEM_RD(R1R0)];
+		TRACE("r4:a=%02x", a);
+		s->r[4] = a >> 4; a &= 15;
+		FUSE(x == 0x05) MEM_WR(R1R0, a);
+		break;
+	case 0x4e: /* READ MR0A */
+		a = rom[(pc & 0xf00) | a << 4 | s->r[4]];
+		TRACE("m[%02x]:a=%02x", R1R0, a);
+		MEM_WR(R1R0, a >> 4); a &= 15; break;
+	case 0x4f: /* READF MR0A */
+		a = rom[0xf00 | a << 4 | s->r[4]];
+		TRACE("m[%02x]:a=%02x", R1R0, a);
+		MEM_WR(R1R0, a >> 4); a &= 15; break;
+
+#define CASE8(x) \
+	case x:     case x + 1: case x + 2: case x + 3: \
+	case x + 4: case x + 5: case x + 6: case x + 7:
+
+	CASE8(0x50) CASE8(0x58) // MOV R1R0, imm8
+		s->r[0] = op & 0xf; s->r[1] = rom[++pc & 0xfff] & 15; TRACE("r1r0=%02x", R1R0);
+		// followed by MOV A, [R1R0] or READ R4A (and MOV [R1R0], A)
+		FUSE(x == 0x04) a = MEM_RD(R1R0);
+		else FUSE(x == 0x4c) {
+			a = rom[(pc & 0xf00) | a << 4 | MEM_RD(R1R0)];
+			s->r[4] = a >> 4; a &= 15;
+			FUSE(ticks > 2 && x == 0x05) { n = 3; MEM_WR(R1R0, a); }
+		}
+		break;
+	CASE8(0x60) CASE8(0x68) // MOV R3R2, imm8
+		s->r[2] = op & 0xf; s->r[3] = rom[++pc & 0xfff] & 15; TRACE("r3r2=%02x", R3R2);
+		FUSE(x == 0x06) a = MEM_RD(R3R2);
+		break;
+
+	CASE8(0x70) CASE8(0x78) /* MOV A, imm4 */ a = op & 15; TRACE("a=%x", a);
+		// followed by MOV [R1R0], A
+		FUSE(x == 0x05) MEM_WR(R1R0, a);
+		break;
+
+#define JMP11 \
+	x = (pc & 0x800) | (op & 7) << 8 | rom[(pc + 1) & 0xfff]; pc++;
+#define TRACE_JUMP TRACE("pc=%03x", pc + 1); else TRACE("no jump")
+#define X(cond) JMP11 if (cond) pc = x - 1, TRACE_JUMP; break;
+	CASE8(0x80) CASE8(0x88) // JAn imm11
+	CASE8(0x90) CASE8(0x98) X(a >> (op >> 3 & 3) & 1)
+	CASE8(0xa0) /* JNZ R0, imm11 */ X(s->r[0])
+	CASE8(0xa8) /* JNZ R1, imm11 */ X(s->r[1])
+	CASE8(0xb0) /* JZ A, imm11 */ X(!a)
+	CASE8(0xb8) /* JNZ A, imm11 */ X(a)
+	CASE8(0xc0) /* JC imm11 */ X(cf)
+	CASE8(0xc8) /* JNC imm11 */ X(!cf)
+	CASE8(0xd0) /* JTMR imm11 */ TIMER_SYNC JMP11 if (s->tf) pc = x - 1, TRACE_JUMP; s->tf = 0; break;
+	CASE8(0xd8) /* JNZ R4, imm11 */ X(s->r[4])
+#undef X
+#undef JMP11
+
+	CASE8(0xe0) CASE8(0xe8) // JMP imm12
+		pc = (op & 15) << 8 | rom[(pc + 1) & 0xfff];
+		TRACE("pc=%03x", pc);
+		pc--; break;
+	CASE8(0xf0) CASE8(0xf8) // CALL imm12
+		s->stack = (pc + 2) & 0xfff;
+		pc = (op & 15) << 8 | rom[(pc + 1) & 0xfff];
+		TRACE("pc=%03x,ret=%03x", pc, s->stack);
+		pc--; break;
+
+	default: // stops at the opcode
+		c->err = CPU_ERR_OPCODE;
+		goto stop;
+	} // end switch
+#undef FUSE
+
+#if CPU_TRACE
+		fprintf(stderr, "\n");
+#endif
+		pc = (pc + 1) & 0xfff;
+#if CPU_COV
+		// conditional jumps
+		if ((unsigned)(op - 0x80) < 0x60)
+			COV_JUMP_AT(pc0, pc != ((pc0 + 2) & 0xfff));
+#endif
+		ticks -= n;
+
+#if CPU_DEBUG
+		// watchpoints stop after the instruction
+		if (dbg.hit) break;
+#endif
+	} // end while
+
+stop:
+	TIMER_SYNC
+	ticks += left;
+	s->pc = pc; s->a = a; s->cf = cf;
+	c->tmr_frac = tmr_frac;
+	c->tickcount -= ticks;
+	return ticks;
+}
+#endif
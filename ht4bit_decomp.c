@@ -52,7 +52,7 @@ static unsigned mark_opcodes(uint8_t *rom, unsigned pc, uint8_t *marks) {
 		case 0x47: // TIMER imm8
 		CASE8(0x50) CASE8(0x58) // MOV R1R0, imm8
 		CASE8(0x60) CASE8(0x68) // MOV R3R2, imm8
-			marks[++pc] |= 2; break;
+			marks[++pc & 0xfff] |= 2; break;
 
 		case 0x4c: /* READ R4A */
 		case 0x4d: /* READF R4A */
@@ -91,8 +91,12 @@ static unsigned mark_opcodes(uint8_t *rom, unsigned pc, uint8_t *marks) {
 	return read_mask;
 }
 
-static void decompile(uint8_t *rom, uint8_t *marks, unsigned read_mask, FILE *fo) {
-	unsigned pc;
+// coverage map from the emulator (--cov)
+enum { COV_EXEC = 1, COV_TAKEN = 2, COV_NOT_TAKEN = 4 };
+
+static void decompile(uint8_t *rom, uint8_t *marks, unsigned read_mask,
+		const uint8_t *cov, FILE *fo) {
+	unsigned pc, cold = 0;
 
 #define OUT(...) fprintf(fo, "\t" __VA_ARGS__)
 
@@ -132,6 +136,19 @@ static void decompile(uint8_t *rom, uint8_t *marks, unsigned read_mask, FILE *fo
 		if (x & 8) fprintf(fo, "f_%03x:\n", pc);
 		op = rom[pc];
 		if (!(x & 1)) { OUT("// 0x%02x\n", op); continue; }
+		if (cov) {
+			unsigned y = cov[pc];
+			// repeated after labels
+			if (x & 12) cold = 0;
+			if ((~y & COV_EXEC) != cold) {
+				cold ^= 1;
+				if (cold) OUT("// not executed\n");
+			}
+			// conditional jumps
+			if ((unsigned)(op - 0x80) < 0x60 && y & COV_EXEC &&
+					(y & (COV_TAKEN | COV_NOT_TAKEN)) != (COV_TAKEN | COV_NOT_TAKEN))
+				OUT("// %s taken\n", y & COV_TAKEN ? "always" : "never");
+		}
 
 		switch (op) {
 		case 0x00: /* RR A */ OUT("RR\n"); break;
@@ -279,11 +296,20 @@ static void decompile(uint8_t *rom, uint8_t *marks, unsigned read_mask, FILE *fo
 	}
 }
 
+#if FUZZ
+// libFuzzer entry point ("make fuzz"), the input is a ROM
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	uint8_t rom[0x1000] = { 0 }, marks[0x1000] = { 0 };
+	memcpy(rom, data, size < sizeof(rom) ? size : sizeof(rom));
+	mark_opcodes(rom, 0, marks);
+	return 0;
+}
+#else
 int main(int argc, char **argv) {
 	const char *rom_fn = "brickrom.bin";
-	const char *marks_fn = NULL;
+	const char *marks_fn = NULL, *cov_fn = NULL;
 	const char *output_fn = "decomp_out.c";
-	uint8_t rom[0x1000], marks[0x1000];
+	uint8_t rom[0x1000], marks[0x1000], cov[0x1000];
 	FILE *f; unsigned n, read_mask;
 
 	while (argc > 1) {
@@ -295,6 +321,10 @@ int main(int argc, char **argv) {
 			if (argc <= 2) ERR_EXIT("bad option\n");
 			marks_fn = argv[2];
 			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "-c")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			cov_fn = argv[2];
+			argc -= 2; argv += 2;
 		} else if (!strcmp(argv[1], "-o")) {
 			if (argc <= 2) ERR_EXIT("bad option\n");
 			output_fn = argv[2];
@@ -308,6 +338,14 @@ int main(int argc, char **argv) {
 	fclose(f);
 	if (n != sizeof(rom)) ERR_EXIT("unexpected ROM size\n");
 
+	if (cov_fn) {
+		f = fopen(cov_fn, "rb");
+		if (!f) ERR_EXIT("fopen failed\n");
+		n = fread(cov, 1, sizeof(cov), f);
+		fclose(f);
+		if (n != sizeof(cov)) ERR_EXIT("unexpected coverage map size\n");
+	}
+
 	memset(marks, 0, 0x1000);
 	read_mask = mark_opcodes(rom, 0, marks);
 
@@ -322,8 +360,9 @@ int main(int argc, char **argv) {
 	if (output_fn) {
 		f = fopen(output_fn, "wb");
 		if (f) {
-			decompile(rom, marks, read_mask, f);
+			decompile(rom, marks, read_mask, cov_fn ? cov : NULL, f);
 			fclose(f);
 		}
 	}
 }
+#endif